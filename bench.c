@@ -0,0 +1,425 @@
+#include "mem_manage.h"
+#include "mm_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef USE_SYSTEM_MALLOC
+    #define mm_malloc malloc
+    #define mm_free free
+    #define mm_realloc realloc
+    #define mm_calloc calloc
+    #define mm_aligned_alloc aligned_alloc
+    #include <malloc.h> // For mallinfo2
+    #define mm_init(size) ((void)0) // No-op for system malloc
+    #define ALLOCATOR "system"
+#else
+    #define ALLOCATOR "mm"
+#endif
+
+#define WINDOW 1024           // Live blocks per thread in the churn and random workloads
+#define RING_SIZE 4096        // Slots of a producer/consumer ring (a power of two)
+#define REALLOC_LIMIT (64 * 1024) // A growing buffer starts over beyond this size
+
+typedef struct Options {
+    const char* workload;
+    size_t size;      // Block size, or the largest one for random sizes
+    size_t count;     // Operations per thread
+    unsigned threads;
+    const char* trace_path;                // Trace file to replay
+    const struct mm_trace_record* trace;   // Its records, in call order
+} Options;
+
+/**
+ * State of one benchmark thread. Latencies go to a slice of a mapping
+ * shared by all threads, so that measuring does not allocate.
+ */
+typedef struct Worker {
+    const Options* opt;
+    unsigned index;
+    uint32_t* latency;  // Nanoseconds per timed call
+    size_t timed;       // Entries used in latency
+    struct Ring* ring;  // Producer/consumer pair only
+} Worker;
+
+typedef struct Ring {
+    void* slots[RING_SIZE];
+    _Alignas(64) atomic_size_t head; // Next slot the producer fills
+    _Alignas(64) atomic_size_t tail; // Next slot the consumer empties
+} Ring;
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline void record(Worker* w, uint64_t start) {
+    uint64_t elapsed = now_ns() - start;
+    w->latency[w->timed++] = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+}
+
+/**
+ * Fixed-size churn: replace the oldest of WINDOW live blocks on every
+ * operation.
+ */
+static void* run_churn(void* arg) {
+    Worker* w = arg;
+    void* live[WINDOW] = { NULL };
+
+    for (size_t i = 0; i < w->opt->count; i++) {
+        void** slot = &live[i % WINDOW];
+        uint64_t start = now_ns();
+        mm_free(*slot);
+        *slot = mm_malloc(w->opt->size);
+        record(w, start);
+        *(char*)*slot = (char)i;
+    }
+    for (int i = 0; i < WINDOW; i++)
+        mm_free(live[i]);
+    return NULL;
+}
+
+/**
+ * Random sizes between 1 and the size option, replacing random live blocks.
+ */
+static void* run_random(void* arg) {
+    Worker* w = arg;
+    void* live[WINDOW] = { NULL };
+    unsigned seed = w->index + 1;
+
+    for (size_t i = 0; i < w->opt->count; i++) {
+        void** slot = &live[rand_r(&seed) % WINDOW];
+        size_t size = (size_t)rand_r(&seed) % w->opt->size + 1;
+        uint64_t start = now_ns();
+        mm_free(*slot);
+        *slot = mm_malloc(size);
+        record(w, start);
+        *(char*)*slot = (char)i;
+    }
+    for (int i = 0; i < WINDOW; i++)
+        mm_free(live[i]);
+    return NULL;
+}
+
+/**
+ * Producers allocate and consumers free: even workers produce into the
+ * ring they share with the next odd worker.
+ */
+static void* run_prodcons(void* arg) {
+    Worker* w = arg;
+    Ring* ring = w->ring;
+    bool producer = w->index % 2 == 0;
+
+    for (size_t i = 0; i < w->opt->count; i++) {
+        if (producer) {
+            size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == RING_SIZE)
+                ; // Full: wait for the consumer
+            uint64_t start = now_ns();
+            void* ptr = mm_malloc(w->opt->size);
+            record(w, start);
+            *(char*)ptr = (char)i;
+            ring->slots[head % RING_SIZE] = ptr;
+            atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        } else {
+            size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            while (atomic_load_explicit(&ring->head, memory_order_acquire) == tail)
+                ; // Empty: wait for the producer
+            void* ptr = ring->slots[tail % RING_SIZE];
+            atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+            uint64_t start = now_ns();
+            mm_free(ptr);
+            record(w, start);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Grow a buffer by the size option per realloc until it passes
+ * REALLOC_LIMIT, then start over.
+ */
+static void* run_realloc(void* arg) {
+    Worker* w = arg;
+    char* buffer = NULL;
+    size_t size = 0;
+
+    for (size_t i = 0; i < w->opt->count; i++) {
+        size = size >= REALLOC_LIMIT ? w->opt->size : size + w->opt->size;
+        uint64_t start = now_ns();
+        if (size == w->opt->size) {
+            mm_free(buffer);
+            buffer = mm_malloc(size);
+        } else {
+            buffer = mm_realloc(buffer, size);
+        }
+        record(w, start);
+        buffer[size - 1] = (char)i;
+    }
+    mm_free(buffer);
+    return NULL;
+}
+
+static int compare_time(const void* a, const void* b);
+
+/**
+ * Table from the addresses in a trace to the blocks allocated for them
+ * while replaying it: linear probing, with backward-shift deletion.
+ */
+typedef struct Replayed {
+    uint64_t key;  // Address in the trace, 0 for an empty slot
+    void* ptr;
+} Replayed;
+
+static Replayed* replay_table;
+static size_t replay_mask;
+static size_t replay_live;        // Bytes requested by live blocks
+static size_t replay_peak_live;
+static char replay_summary[256];  // Heap figures taken at the end of the replay
+
+static size_t replay_slot(uint64_t key) {
+    size_t i = (size_t)((key >> 4) * 0x9E3779B97F4A7C15ull) & replay_mask;
+    while (replay_table[i].key && replay_table[i].key != key)
+        i = (i + 1) & replay_mask;
+    return i;
+}
+
+static void replay_remove(size_t i) {
+    for (size_t j = (i + 1) & replay_mask; replay_table[j].key; j = (j + 1) & replay_mask) {
+        size_t home = (size_t)((replay_table[j].key >> 4) * 0x9E3779B97F4A7C15ull) & replay_mask;
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            replay_table[i] = replay_table[j];
+            i = j;
+        }
+    }
+    replay_table[i].key = 0;
+}
+
+static size_t replay_size(void* ptr) {
+#ifdef USE_SYSTEM_MALLOC
+    return malloc_usable_size(ptr);
+#else
+    return mm_usable_size(ptr);
+#endif
+}
+
+/**
+ * Replay a recorded trace on one thread, in the order of its timestamps.
+ * Calls whose block is unknown (their allocation was not recorded) are
+ * skipped.
+ */
+static void* run_replay(void* arg) {
+    Worker* w = arg;
+
+    for (size_t i = 0; i < w->opt->count; i++) {
+        const struct mm_trace_record* r = &w->opt->trace[i];
+        size_t slot = 0;
+        void* old = NULL;
+        if (r->op == MM_OP_FREE || (r->op == MM_OP_REALLOC && r->old)) {
+            slot = replay_slot(r->old);
+            if (!replay_table[slot].key)
+                continue;
+            old = replay_table[slot].ptr;
+            replay_live -= replay_size(old);
+            replay_remove(slot);
+        }
+
+        void* ptr = NULL;
+        uint64_t start = now_ns();
+        switch (r->op) {
+            case MM_OP_MALLOC: ptr = mm_malloc(r->size); break;
+            case MM_OP_CALLOC: ptr = mm_calloc(1, r->size); break;
+            case MM_OP_ALIGNED: ptr = mm_aligned_alloc(r->old, r->size); break;
+            case MM_OP_FREE: mm_free(old); break;
+            case MM_OP_REALLOC: ptr = mm_realloc(old, r->size); break;
+        }
+        record(w, start);
+
+        if (ptr && r->ptr) {
+            replay_table[replay_slot(r->ptr)] = (Replayed){ r->ptr, ptr };
+            replay_live += replay_size(ptr);
+            if (replay_live > replay_peak_live)
+                replay_peak_live = replay_live;
+        }
+    }
+
+#ifdef USE_SYSTEM_MALLOC
+    struct mallinfo2 info = mallinfo2();
+    snprintf(replay_summary, sizeof(replay_summary), " live=%zuKiB peak_live=%zuKiB heap=%zuKiB",
+             replay_live / 1024, replay_peak_live / 1024, (info.arena + info.hblkhd) / 1024);
+#else
+    struct mm_stats stats;
+    mm_stats(&stats);
+    snprintf(replay_summary, sizeof(replay_summary), " live=%zuKiB peak_live=%zuKiB heap=%zuKiB fragmentation=%.3f",
+             replay_live / 1024, replay_peak_live / 1024,
+             (stats.bytes_in_use + stats.bytes_free) / 1024, stats.fragmentation);
+#endif
+
+    for (size_t i = 0; i <= replay_mask; i++) {
+        if (replay_table[i].key)
+            mm_free(replay_table[i].ptr);
+    }
+    return NULL;
+}
+
+/**
+ * Map a trace file and get its records in call order, with a table big
+ * enough for every block it allocates. Returns the record count, or 0.
+ */
+static size_t load_trace(Options* opt) {
+    int fd = open(opt->trace_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct mm_trace_header)) {
+        perror(opt->trace_path);
+        return 0;
+    }
+    char* file = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        perror("mmap");
+        return 0;
+    }
+
+    const struct mm_trace_header* header = (const struct mm_trace_header*)file;
+    if (memcmp(header->magic, MM_TRACE_MAGIC, sizeof(MM_TRACE_MAGIC)) != 0 ||
+        header->version != MM_TRACE_VERSION || header->record_size != sizeof(struct mm_trace_record)) {
+        fprintf(stderr, "%s: not a version %d allocation trace\n", opt->trace_path, MM_TRACE_VERSION);
+        return 0;
+    }
+
+    struct mm_trace_record* records = (struct mm_trace_record*)(file + sizeof(*header));
+    size_t count = ((size_t)st.st_size - sizeof(*header)) / sizeof(*records);
+    qsort(records, count, sizeof(*records), compare_time);
+
+    size_t slots = 16;
+    while (slots < 2 * count)
+        slots *= 2;
+    replay_table = mmap(NULL, slots * sizeof(Replayed), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (replay_table == MAP_FAILED) {
+        perror("mmap");
+        return 0;
+    }
+    replay_mask = slots - 1;
+    opt->trace = records;
+    return count;
+}
+
+static int compare_latency(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t* sorted, size_t n, double p) {
+    if (n == 0)
+        return 0;
+    size_t i = (size_t)(p * (double)(n - 1));
+    return sorted[i];
+}
+
+static int compare_time(const void* a, const void* b) {
+    uint64_t x = ((const struct mm_trace_record*)a)->time_ns, y = ((const struct mm_trace_record*)b)->time_ns;
+    return (x > y) - (x < y);
+}
+
+static void usage(const char* prog) {
+    printf("Usage: %s [-w churn|random|prodcons|realloc] [-s size] [-n count] [-t threads]\n"
+           "       %s -w replay -f trace\n", prog, prog);
+}
+
+int main(int argc, char* argv[]) {
+    Options opt = { "churn", 64, 1000000, 1, NULL, NULL };
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-w") == 0)
+            opt.workload = argv[i + 1];
+        else if (strcmp(argv[i], "-s") == 0)
+            opt.size = strtoull(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "-n") == 0)
+            opt.count = strtoull(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "-t") == 0)
+            opt.threads = (unsigned)atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-f") == 0)
+            opt.trace_path = argv[i + 1];
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc % 2 == 0 || opt.size == 0 || opt.count == 0 || opt.threads == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    void* (*run)(void*);
+    if (strcmp(opt.workload, "churn") == 0)
+        run = run_churn;
+    else if (strcmp(opt.workload, "random") == 0)
+        run = run_random;
+    else if (strcmp(opt.workload, "prodcons") == 0) {
+        run = run_prodcons;
+        opt.threads += opt.threads % 2; // Whole producer/consumer pairs
+    } else if (strcmp(opt.workload, "realloc") == 0)
+        run = run_realloc;
+    else if (strcmp(opt.workload, "replay") == 0 && opt.trace_path) {
+        run = run_replay;
+        opt.threads = 1;
+        opt.count = load_trace(&opt);
+        if (opt.count == 0)
+            return 1;
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Bookkeeping lives outside the allocator under test
+    size_t total = opt.count * opt.threads;
+    size_t bytes = total * sizeof(uint32_t) + opt.threads * (sizeof(Worker) + sizeof(Ring));
+    char* mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    Ring* rings = (Ring*)mem;
+    Worker* workers = (Worker*)(rings + opt.threads);
+    uint32_t* latency = (uint32_t*)(workers + opt.threads);
+    pthread_t threads[opt.threads];
+
+    mm_init(1 << 20);
+    uint64_t start = now_ns();
+    for (unsigned i = 0; i < opt.threads; i++) {
+        workers[i] = (Worker){ &opt, i, latency + i * opt.count, 0, &rings[i / 2] };
+        pthread_create(&threads[i], NULL, run, &workers[i]);
+    }
+    for (unsigned i = 0; i < opt.threads; i++)
+        pthread_join(threads[i], NULL);
+    double seconds = (double)(now_ns() - start) / 1e9;
+
+    // Pack the timed calls of all threads together before sorting
+    size_t timed = 0;
+    for (unsigned i = 0; i < opt.threads; i++) {
+        memmove(latency + timed, workers[i].latency, workers[i].timed * sizeof(uint32_t));
+        timed += workers[i].timed;
+    }
+    qsort(latency, timed, sizeof(uint32_t), compare_latency);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%-8s %-6s threads=%u size=%zu ops=%zu ops/s=%.0f p50=%uns p99=%uns p999=%uns maxrss=%ldKiB%s\n",
+           opt.workload, ALLOCATOR, opt.threads, opt.size, timed, (double)timed / seconds,
+           percentile(latency, timed, 0.50), percentile(latency, timed, 0.99),
+           percentile(latency, timed, 0.999), usage.ru_maxrss, replay_summary);
+
+    munmap(mem, bytes);
+    return 0;
+}
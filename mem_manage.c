@@ -1,225 +1,3422 @@
+#define _GNU_SOURCE // mremap
 #include "mem_manage.h"
+#include "mm_trace.h"
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdlib.h>
+#include <sys/auxv.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <execinfo.h>
 
-#define MAX_HEAP_SIZE 1024 // Maximum number of free blocks in the heap
+// Diagnostic output is compiled in only when MM_TRACE_LEVEL is raised at
+// build time (e.g. make TRACE=2). At the default level every MM_TRACE call
+// folds away, so the malloc/free paths never touch stdio.
+#define MM_TRACE_ERROR 1 // Misuse and initialization failures, to stderr
+#define MM_TRACE_OPS   2 // Every heap operation, to stdout
+
+#ifndef MM_TRACE_LEVEL
+#define MM_TRACE_LEVEL 0
+#endif
+
+// Hardened builds (make HARDENED=1) check every free for corruption and
+// misuse and abort when they find any; see the hardened section below
+#ifndef MM_HARDENED
+#define MM_HARDENED 0
+#endif
+
+#define MM_TRACE(level, ...)                                                  \
+    do {                                                                      \
+        if (MM_TRACE_LEVEL >= (level))                                        \
+            fprintf((level) <= MM_TRACE_ERROR ? stderr : stdout, __VA_ARGS__); \
+    } while (0)
+
+#define ALIGNMENT 8 // Payload sizes are rounded to a multiple of this
 
 typedef struct Block {
-    size_t size;         // Size of the block
-    bool is_free;        // Whether the block is free
-    struct Block* next;  // Pointer to the next block (for splitting, etc.)
+    size_t size;         // Payload size of the block, with FLAG_* in the low bits
 } Block;
 
-static void* heap_start = NULL;   // Starting address of the managed heap
-static size_t heap_size = 0;      // Total size of the managed heap
-static Block* heap[MAX_HEAP_SIZE]; // Min-heap to track free blocks
-static size_t heap_count = 0;     // Number of blocks in the heap
+/**
+ * View of a free or thread-cached block. Its list links live in the first
+ * payload words, which nobody else uses while the block is not handed out.
+ */
+typedef struct FreeBlock {
+    size_t size;         // Same header word as Block.size
+    Block* next;         // Next free block in the same size class
+    Block* prev;         // Previous free block in the same size class
+} FreeBlock;
+
+// Free blocks of up to SMALL_BIN_MAX bytes of payload are kept in
+// segregated lists, one exact-size bin per ALIGNMENT step, with a bitmap of
+// the non-empty bins. Larger free blocks go into a size-ordered tree.
+#define SMALL_BIN_COUNT 64
+#define SMALL_BIN_MAX (SMALL_BIN_COUNT * ALIGNMENT)
+
+/**
+ * View of a large free block as a node of a left-leaning red-black tree
+ * ordered by size, then address. The links overlay FreeBlock.next/prev; the
+ * node's colour lives in the low bit of the right link.
+ */
+typedef struct TreeNode {
+    size_t size;                  // Same header word as Block.size
+    struct TreeNode* left;
+    uintptr_t right_red;          // Right child | 1 if this node is red
+} TreeNode;
+
+// Flags packed into the low bits of Block.size (sizes are ALIGNMENT multiples)
+#define FLAG_FREE      ((size_t)1) // This block is free
+#define FLAG_PREV_FREE ((size_t)2) // The physically previous block is free
+#define FLAG_MMAPPED   ((size_t)4) // The block has a mapping of its own
+#define FLAG_MASK      ((size_t)(ALIGNMENT - 1))
+
+// The top bits of Block.size hold the id of the heap that owns the block,
+// so a free from any thread can find its way back without a lookup. Above
+// them, blocks carved in cache-line isolated runs carry the tag of the
+// thread they were carved for. The bit below the id marks blocks the heap
+// profiler sampled.
+#define HEAP_ID_SHIFT 48
+#define HEAP_ID_MASK 0xFF
+#define THREAD_TAG_SHIFT 56
+#define FLAG_SAMPLED ((size_t)1 << (HEAP_ID_SHIFT - 1))
+#define SIZE_MASK ((FLAG_SAMPLED - 1) & ~FLAG_MASK)
+
+// Free blocks end with a footer word holding their payload size, so the
+// block that follows can find its predecessor in constant time.
+typedef size_t Footer;
+
+// Align size to 8 bytes
+#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(size_t)(ALIGNMENT - 1))
+
+// Smallest payload a block can have: room for the free-list links and the
+// footer once it is freed
+#define MIN_PAYLOAD (sizeof(FreeBlock) - sizeof(Block) + sizeof(Footer))
+
+// Minimum block size to store metadata
+#define MIN_BLOCK_SIZE (sizeof(Block) + MIN_PAYLOAD)
+
+// Hardened builds keep a canary in the last payload word of in-use blocks
+#define CANARY_SIZE (MM_HARDENED ? sizeof(size_t) : 0)
+
+// Payload size of a block that can hold size bytes
+#define PAYLOAD_SIZE(size) (ALIGN(size) < MIN_PAYLOAD ? MIN_PAYLOAD : ALIGN(size))
+
+// Payload size that serves a request of size bytes
+#define REQUEST_SIZE(size) PAYLOAD_SIZE((size) + CANARY_SIZE)
+
+/**
+ * A contiguous piece of memory managed by a heap: this header, then the
+ * blocks, then a one-word epilogue header. Heaps start with one segment and
+ * grow by appending more; a new piece that starts where the newest segment
+ * ends is merged into it instead.
+ */
+typedef struct Segment {
+    struct Segment* next;  // Next segment of the same heap, newest first
+    size_t size;           // Bytes from this header to the end of the epilogue
+    bool mapped;           // Obtained with mmap (unmapped on release) or sbrk
+} Segment;
+
+#define SEGMENT_HEADER ALIGN(sizeof(Segment))
+#define SEGMENT_OVERHEAD (SEGMENT_HEADER + sizeof(size_t))
+
+#define MM_GROW_MIN ((size_t)64 * 1024) // Smallest extension of a heap
+
+// Larger requests cannot be represented in a header and are refused
+#define MM_MAX_REQUEST ((size_t)1 << (HEAP_ID_SHIFT - 2))
+
+/**
+ * One independently locked heap. The heap set up by mm_init is arena 0;
+ * further arenas are mapped on demand so threads spread over several locks.
+ * Blocks freed by a thread that uses a different arena are pushed onto
+ * remote_free without taking the lock and merged by the next thread that
+ * locks the owner.
+ */
+typedef struct Heap {
+    pthread_mutex_t lock;
+    unsigned id;                  // Index in heaps[], stored in block headers
+    Segment* segments;            // Managed memory, newest segment first
+    _Atomic(char*) lo;            // Lowest address of any segment (frees read it unlocked)
+    _Atomic(char*) hi;            // End of the highest segment (likewise)
+    bool use_sbrk;                // Grow with sbrk before falling back to mmap
+    char* fresh;                  // [fresh, fresh_end) was never handed out
+    char* fresh_end;
+    Block* bins[SMALL_BIN_COUNT]; // Segregated free lists of small blocks
+    uint64_t bin_map;             // Bit i set when bins[i] is non-empty
+    TreeNode* tree;               // Free blocks above SMALL_BIN_MAX
+    _Atomic(Block*) remote_free;  // Lock-free stack chained through FreeBlock.next
+    size_t in_use;                // Bytes of blocks off the free lists, headers included
+    size_t peak;                  // Highest in_use since the heap was set up
+    size_t page;                  // Unit of growth and decommit: base or huge page size
+    Block* walk_mark;             // Where a paused mm_walk resumes (see heap_walk)
+} Heap;
+
+#define MM_MAX_ARENAS 64
+#define MM_MAX_HEAPS 256 // Arenas plus heaps made by mm_heap_create
+
+static Heap main_heap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static _Atomic(Heap*) heaps[MM_MAX_HEAPS];    // Heaps by id; slot 0 is main_heap, arenas come first
+static unsigned arena_count;                   // Arenas threads are spread over
+static size_t arena_size;                      // Region size of each arena
+static unsigned numa_nodes = 1;                // Memory nodes arenas are spread over
+static atomic_uint next_arena;                 // Round-robin arena assignment
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint heap_epoch;    // Bumped by mm_init/mm_cleanup to invalidate caches
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER; // Serializes lazy initialization
+static pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER; // One mm_walk at a time; heaps outlive it
+static pthread_mutex_t sample_lock = PTHREAD_MUTEX_INITIALIZER; // Guards the heap profile's sample table
+
+// Event counters are per thread, so counting needs no atomic
+// read-modify-write: only the owner thread writes its counters. mm_stats sums
+// the counters of live threads and those retired by threads that exited.
+enum { STAT_MALLOC, STAT_FREE, STAT_REALLOC, STAT_SPLIT, STAT_COALESCE, STAT_COUNT };
+
+typedef struct ThreadStats {
+    atomic_size_t events[STAT_COUNT];
+    atomic_size_t sizes[MM_STATS_SIZE_CLASSES]; // Requests per size class
+    struct ThreadStats* next;                   // Registered threads
+} ThreadStats;
+
+static __thread ThreadStats thread_stats __attribute__((tls_model("initial-exec")));
+static ThreadStats* stats_threads;  // Threads with live counters
+static ThreadStats stats_retired;   // Sum of the counters of exited threads
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Bytes held by mapped blocks, headers included, and their high-water mark
+static atomic_size_t mapped_in_use;
+static atomic_size_t mapped_peak;
+
+// Free blocks that coalescing makes at least this large have their interior
+// pages given back to the OS right away (0 = never). MADV_FREE lets the
+// kernel take them lazily, without a page fault if they are reused first.
+#define MM_DECOMMIT_THRESHOLD_DEFAULT ((size_t)1024 * 1024)
+#ifdef MADV_FREE
+#define MADV_LAZY MADV_FREE
+#else
+#define MADV_LAZY MADV_DONTNEED
+#endif
+
+static atomic_size_t decommit_threshold = MM_DECOMMIT_THRESHOLD_DEFAULT;
+static atomic_int central_poppers; // Central free-list pops in flight (see central_pop)
+
+// Huge page size new heaps are backed with (0 = base pages). Such heaps
+// map memory in whole, aligned huge pages, from hugetlbfs if it has any to
+// spare or else as transparent huge pages, and decommit only whole huge
+// pages so trimming never splits one.
+static atomic_size_t huge_page_size;
+
+// Optional background thread that runs mm_trim(0) every decommit_interval_ms
+static pthread_mutex_t decommit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t decommit_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t decommit_thread;
+static bool decommit_running;
+static size_t decommit_interval_ms;
+
+// Heap size used when memory is requested before any mm_init
+#define MM_DEFAULT_HEAP_SIZE ((size_t)1 << 20)
+
+static size_t page_size(void) {
+    static size_t page;
+    if (!page)
+        page = (size_t)sysconf(_SC_PAGESIZE);
+    return page;
+}
+
+static inline size_t page_round(size_t bytes) {
+    return (bytes + page_size() - 1) & ~(page_size() - 1);
+}
+
+static inline char* page_align_up(char* addr) {
+    return (char*)page_round((uintptr_t)addr);
+}
+
+static inline uintptr_t round_up(uintptr_t value, size_t unit) {
+    return (value + unit - 1) & ~(uintptr_t)(unit - 1);
+}
+
+// The owner of an in-use block reads its header without the heap lock while
+// another thread may flip FLAG_PREV_FREE in it under the lock. Relaxed
+// atomic accesses keep that well-defined and compile to plain moves.
+static inline size_t hdr_get(const Block* block) {
+    return __atomic_load_n(&block->size, __ATOMIC_RELAXED);
+}
+
+static inline void hdr_set(Block* block, size_t value) {
+    __atomic_store_n(&block->size, value, __ATOMIC_RELAXED);
+}
+
+static inline size_t heap_bits(const Heap* h) {
+    return (size_t)h->id << HEAP_ID_SHIFT;
+}
+
+/**
+ * Whether ptr lies in the address range of h's segments. Frees check this
+ * without the heap lock while the heap may grow or shrink. Growing only
+ * widens the range and trimming only cuts off free memory, so a block
+ * that is in use is always inside.
+ */
+static inline bool heap_contains(Heap* h, const void* ptr) {
+    return (const char*)ptr >= atomic_load_explicit(&h->lo, memory_order_relaxed) &&
+           (const char*)ptr < atomic_load_explicit(&h->hi, memory_order_relaxed);
+}
+
+static inline size_t block_size(const Block* block) {
+    return hdr_get(block) & SIZE_MASK;
+}
+
+static inline bool block_is_free(const Block* block) {
+    return (hdr_get(block) & FLAG_FREE) != 0;
+}
+
+static inline unsigned block_heap_id(const Block* block) {
+    return (unsigned)(hdr_get(block) >> HEAP_ID_SHIFT) & HEAP_ID_MASK;
+}
+
+static inline void* block_payload(Block* block) {
+    return (char*)block + sizeof(Block);
+}
+
+static inline FreeBlock* as_free(Block* block) {
+    return (FreeBlock*)block;
+}
+
+static inline Block* next_block(Block* block) {
+    return (Block*)((char*)block + sizeof(Block) + block_size(block));
+}
+
+/**
+ * Previous physical block; only valid when FLAG_PREV_FREE is set.
+ */
+static inline Block* prev_block(Block* block) {
+    Footer prev_size = *((Footer*)block - 1);
+    return (Block*)((char*)block - prev_size - sizeof(Block));
+}
+
+/**
+ * Mark a block free with the given payload size and write its footer.
+ * The caller guarantees the previous block is in use (free neighbours are
+ * always coalesced), so FLAG_PREV_FREE is cleared.
+ */
+static void mark_free(Heap* h, Block* block, size_t size) {
+    hdr_set(block, size | FLAG_FREE | heap_bits(h));
+    *(Footer*)((char*)block_payload(block) + size - sizeof(Footer)) = size;
+    Block* next = next_block(block);
+    hdr_set(next, hdr_get(next) | FLAG_PREV_FREE);
+
+    // A walk paused at a header this block swallowed resumes at the block
+    if (h->walk_mark > block && h->walk_mark < next)
+        h->walk_mark = block;
+}
+
+static inline void stat_add(atomic_size_t* counter, size_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void stat_event(int event) {
+    stat_add(&thread_stats.events[event], 1);
+}
+
+/**
+ * Map a request size to its histogram class: class i holds sizes up to
+ * 16 << i bytes, and the last class everything larger.
+ */
+static inline int size_to_stat_class(size_t size) {
+    int cls = size <= 16 ? 0 : 64 - __builtin_clzll(size - 1) - 4;
+    return cls < MM_STATS_SIZE_CLASSES ? cls : MM_STATS_SIZE_CLASSES - 1;
+}
+
+static inline void stat_request(size_t size) {
+    stat_event(STAT_MALLOC);
+    stat_add(&thread_stats.sizes[size_to_stat_class(size)], 1);
+}
+
+static inline void usage_add(Heap* h, size_t bytes) {
+    h->in_use += bytes;
+    if (h->in_use > h->peak)
+        h->peak = h->in_use;
+}
+
+/**
+ * Map a small payload size to the index of the bin that holds it.
+ */
+static inline int size_to_bin(size_t size) {
+    return (int)(size / ALIGNMENT) - 1;
+}
+
+static inline TreeNode* node_right(const TreeNode* n) {
+    return (TreeNode*)(n->right_red & ~(uintptr_t)1);
+}
+
+static inline void node_set_right(TreeNode* n, TreeNode* right) {
+    n->right_red = (uintptr_t)right | (n->right_red & 1);
+}
+
+static inline bool node_red(const TreeNode* n) {
+    return n && (n->right_red & 1);
+}
+
+static inline void node_set_red(TreeNode* n, bool red) {
+    n->right_red = (n->right_red & ~(uintptr_t)1) | red;
+}
+
+static inline void node_flip(TreeNode* n) {
+    n->right_red ^= 1;
+}
+
+static inline bool node_less(const TreeNode* a, const TreeNode* b) {
+    size_t sa = a->size & SIZE_MASK, sb = b->size & SIZE_MASK;
+    return sa < sb || (sa == sb && a < b);
+}
+
+static TreeNode* rotate_left(TreeNode* n) {
+    TreeNode* x = node_right(n);
+    node_set_right(n, x->left);
+    x->left = n;
+    node_set_red(x, node_red(n));
+    node_set_red(n, true);
+    return x;
+}
+
+static TreeNode* rotate_right(TreeNode* n) {
+    TreeNode* x = n->left;
+    n->left = node_right(x);
+    node_set_right(x, n);
+    node_set_red(x, node_red(n));
+    node_set_red(n, true);
+    return x;
+}
+
+static void flip_colors(TreeNode* n) {
+    node_flip(n);
+    node_flip(n->left);
+    node_flip(node_right(n));
+}
+
+static TreeNode* fix_up(TreeNode* n) {
+    if (node_red(node_right(n)) && !node_red(n->left))
+        n = rotate_left(n);
+    if (node_red(n->left) && node_red(n->left->left))
+        n = rotate_right(n);
+    if (node_red(n->left) && node_red(node_right(n)))
+        flip_colors(n);
+    return n;
+}
+
+static TreeNode* tree_insert_at(TreeNode* n, TreeNode* node) {
+    if (!n) {
+        node->left = NULL;
+        node->right_red = 1; // No right child, red
+        return node;
+    }
+    if (node_less(node, n))
+        n->left = tree_insert_at(n->left, node);
+    else
+        node_set_right(n, tree_insert_at(node_right(n), node));
+    return fix_up(n);
+}
+
+static TreeNode* move_red_left(TreeNode* n) {
+    flip_colors(n);
+    if (node_red(node_right(n)->left)) {
+        node_set_right(n, rotate_right(node_right(n)));
+        n = rotate_left(n);
+        flip_colors(n);
+    }
+    return n;
+}
+
+static TreeNode* move_red_right(TreeNode* n) {
+    flip_colors(n);
+    if (node_red(n->left->left)) {
+        n = rotate_right(n);
+        flip_colors(n);
+    }
+    return n;
+}
+
+static TreeNode* tree_remove_min(TreeNode* n) {
+    if (!n->left)
+        return NULL;
+    if (!node_red(n->left) && !node_red(n->left->left))
+        n = move_red_left(n);
+    n->left = tree_remove_min(n->left);
+    return fix_up(n);
+}
+
+static TreeNode* tree_remove_at(TreeNode* n, TreeNode* node) {
+    if (node_less(node, n)) {
+        if (!node_red(n->left) && !node_red(n->left->left))
+            n = move_red_left(n);
+        n->left = tree_remove_at(n->left, node);
+    } else {
+        if (node_red(n->left))
+            n = rotate_right(n);
+        if (n == node && !node_right(n))
+            return NULL;
+        if (!node_red(node_right(n)) && !node_red(node_right(n)->left))
+            n = move_red_right(n);
+        if (n == node) {
+            // Nodes are the blocks themselves, so the successor takes the
+            // removed node's place instead of having its key copied over
+            TreeNode* successor = node_right(n);
+            while (successor->left)
+                successor = successor->left;
+            TreeNode* right = tree_remove_min(node_right(n));
+            successor->left = n->left;
+            successor->right_red = (uintptr_t)right | (n->right_red & 1);
+            n = successor;
+        } else {
+            node_set_right(n, tree_remove_at(node_right(n), node));
+        }
+    }
+    return fix_up(n);
+}
+
+static void tree_insert(Heap* h, TreeNode* node) {
+    h->tree = tree_insert_at(h->tree, node);
+    node_set_red(h->tree, false);
+}
+
+static void tree_remove(Heap* h, TreeNode* node) {
+    if (!node_red(h->tree->left) && !node_red(node_right(h->tree)))
+        node_set_red(h->tree, true);
+    h->tree = tree_remove_at(h->tree, node);
+    if (h->tree)
+        node_set_red(h->tree, false);
+}
+
+/**
+ * Best fit: the smallest (then lowest) free tree block of at least size bytes.
+ */
+static TreeNode* tree_best_fit(const Heap* h, size_t size) {
+    TreeNode* best = NULL;
+    TreeNode* n = h->tree;
+    while (n) {
+        if ((n->size & SIZE_MASK) >= size) {
+            best = n;
+            n = n->left;
+        } else {
+            n = node_right(n);
+        }
+    }
+    return best;
+}
+
+/**
+ * Add a free block to its size-class list, or to the tree if it is large.
+ */
+static void bin_insert(Heap* h, Block* block) {
+    size_t size = block_size(block);
+    if (size > SMALL_BIN_MAX) {
+        tree_insert(h, (TreeNode*)block);
+        MM_TRACE(MM_TRACE_OPS, "Inserting block into tree: Address %p, Size %zu\n", (void*)block, size);
+        return;
+    }
+
+    int bin = size_to_bin(size);
+    as_free(block)->prev = NULL;
+    as_free(block)->next = h->bins[bin];
+    if (h->bins[bin])
+        as_free(h->bins[bin])->prev = block;
+    h->bins[bin] = block;
+    h->bin_map |= 1ULL << bin;
+    MM_TRACE(MM_TRACE_OPS, "Inserting block into bin %d: Address %p, Size %zu\n", bin, (void*)block, size);
+}
+
+/**
+ * Unlink a free block from its size-class list or the tree.
+ */
+static void bin_remove(Heap* h, Block* block) {
+    size_t size = block_size(block);
+    if (size > SMALL_BIN_MAX) {
+        tree_remove(h, (TreeNode*)block);
+        return;
+    }
+
+    int bin = size_to_bin(size);
+    FreeBlock* fb = as_free(block);
+    if (fb->prev)
+        as_free(fb->prev)->next = fb->next;
+    else
+        h->bins[bin] = fb->next;
+    if (fb->next)
+        as_free(fb->next)->prev = fb->prev;
+    if (!h->bins[bin])
+        h->bin_map &= ~(1ULL << bin);
+}
+
+/**
+ * Find and unlink a free block with at least size bytes of payload.
+ */
+static Block* bin_take(Heap* h, size_t size) {
+    Block* block = NULL;
+
+    // Any block in a non-empty small bin at or above the request fits
+    if (size <= SMALL_BIN_MAX) {
+        uint64_t bits = h->bin_map & (~0ULL << size_to_bin(size));
+        if (bits) {
+            int bin = __builtin_ctzll(bits);
+            block = h->bins[bin];
+            MM_TRACE(MM_TRACE_OPS, "Taking block from bin %d: Address %p, Size %zu\n", bin, (void*)block, block_size(block));
+        }
+    }
+
+    if (!block) {
+        block = (Block*)tree_best_fit(h, size);
+        if (!block) {
+            MM_TRACE(MM_TRACE_OPS, "No free block large enough for %zu bytes.\n", size);
+            return NULL;
+        }
+        MM_TRACE(MM_TRACE_OPS, "Taking block from tree: Address %p, Size %zu\n", (void*)block, block_size(block));
+    }
+
+    bin_remove(h, block);
+    return block;
+}
+
+/**
+ * Give the whole pages (huge pages in a huge-page heap) inside a free
+ * block's payload back to the OS. Its links and footer stay where they are.
+ */
+static size_t block_decommit(Heap* h, Block* block, int advice) {
+    char* payload = block_payload(block);
+    char* start = (char*)round_up((uintptr_t)(payload + sizeof(TreeNode) - sizeof(Block)), h->page);
+    char* end = (char*)((uintptr_t)(payload + block_size(block) - sizeof(Footer)) & ~(uintptr_t)(h->page - 1));
+    if (end <= start)
+        return 0;
+    if (madvise(start, (size_t)(end - start), advice) != 0) {
+        // hugetlbfs pages cannot be freed lazily
+        if (advice == MADV_DONTNEED || h->page == page_size() || madvise(start, (size_t)(end - start), MADV_DONTNEED) != 0)
+            return 0;
+    }
+    return (size_t)(end - start);
+}
+
+static size_t tree_decommit(Heap* h, TreeNode* n) {
+    size_t bytes = 0;
+    for (; n; n = node_right(n)) {
+        bytes += tree_decommit(h, n->left);
+        bytes += block_decommit(h, (Block*)n, MADV_DONTNEED);
+    }
+    return bytes;
+}
+
+/**
+ * Take a block with at least size bytes of payload off the free lists and
+ * split off the remainder. *fresh is set when the payload lies in memory
+ * that was never handed out before, so it still reads as zero apart from
+ * the block's own free-list metadata.
+ */
+static Block* heap_alloc(Heap* h, size_t size, bool* fresh) {
+    size = PAYLOAD_SIZE(size);
+    MM_TRACE(MM_TRACE_OPS, "Requested allocation of size %zu (aligned to %zu).\n", size, size);
+
+    Block* block = bin_take(h, size); // Get a block from the first bin that fits
+    if (!block) {
+        MM_TRACE(MM_TRACE_OPS, "Allocation failed. Not enough memory available.\n");
+        return NULL;
+    }
+
+    // Split the block if it's large enough
+    size_t block_bytes = block_size(block);
+    if (block_bytes >= size + MIN_BLOCK_SIZE) {
+        Block* new_block = (Block*)((char*)block + sizeof(Block) + size);
+        mark_free(h, new_block, block_bytes - size - sizeof(Block));
+
+        MM_TRACE(MM_TRACE_OPS, "Splitting block: Allocated size %zu, Remaining size %zu\n", size, block_size(new_block));
+        stat_event(STAT_SPLIT);
+        bin_insert(h, new_block); // Return the remaining part to the free lists
+        block_bytes = size;
+    } else {
+        Block* next = next_block(block);
+        hdr_set(next, hdr_get(next) & ~FLAG_PREV_FREE);
+    }
+
+    hdr_set(block, block_bytes | heap_bits(h)); // In use, and the previous block is never free here
+    usage_add(h, sizeof(Block) + block_bytes);
+
+    char* payload = block_payload(block);
+    char* payload_end = payload + block_bytes;
+    *fresh = payload >= h->fresh && payload < h->fresh_end;
+    if (payload_end > h->fresh && payload < h->fresh_end)
+        h->fresh = payload_end;
+
+    MM_TRACE(MM_TRACE_OPS, "Allocation successful: Block at %p, Size %zu\n", (void*)block, block_bytes);
+    return block;
+}
+
+/**
+ * Return a block to the free lists, merging it with free neighbours.
+ */
+static void heap_free(Heap* h, Block* block) {
+    size_t size = block_size(block);
+    MM_TRACE(MM_TRACE_OPS, "Freeing block at address %p, Size %zu\n", (void*)block, size);
+    h->in_use -= sizeof(Block) + size;
+    size_t largest_part = size;
+
+    // Boundary tags make both neighbours reachable in O(1)
+    Block* next = next_block(block);
+    if (block_is_free(next)) {
+        if (block_size(next) > largest_part)
+            largest_part = block_size(next);
+        MM_TRACE(MM_TRACE_OPS, "Coalescing blocks: Current block %p (Size %zu) with Next block %p (Size %zu)\n",
+                 (void*)block, size, (void*)next, block_size(next));
+        bin_remove(h, next);
+        size += sizeof(Block) + block_size(next);
+        stat_event(STAT_COALESCE);
+
+        // The header and links of next are now inside a payload; where
+        // that is still fresh it must read as zero
+        for (size_t* word = (size_t*)next; word < (size_t*)((FreeBlock*)next + 1); word++) {
+            if ((char*)word >= h->fresh)
+                *word = 0;
+        }
+    }
+
+    if (hdr_get(block) & FLAG_PREV_FREE) {
+        Block* prev = prev_block(block);
+        if (block_size(prev) > largest_part)
+            largest_part = block_size(prev);
+        MM_TRACE(MM_TRACE_OPS, "Coalescing blocks: Previous block %p (Size %zu) with Current block %p (Size %zu)\n",
+                 (void*)prev, block_size(prev), (void*)block, size);
+        bin_remove(h, prev);
+        size += sizeof(Block) + block_size(prev);
+        block = prev;
+        stat_event(STAT_COALESCE);
+    }
+
+    mark_free(h, block, size);
+
+    // Insert the freed block back into the free lists
+    bin_insert(h, block);
+
+    // Decommit once, when a merge first makes the block large; pages that
+    // join it later wait for mm_trim
+    size_t threshold = atomic_load_explicit(&decommit_threshold, memory_order_relaxed);
+    if (threshold && size >= threshold && largest_part < threshold)
+        block_decommit(h, block, MADV_LAZY);
+}
+
+/**
+ * Split the tail off an in-use block so that it keeps size bytes of
+ * payload, if the tail is big enough to become a block of its own. The
+ * tail is freed, merging with a free block that follows it.
+ */
+static void heap_shrink(Heap* h, Block* block, size_t size) {
+    size_t block_bytes = block_size(block);
+    if (block_bytes < size + MIN_BLOCK_SIZE)
+        return;
+
+    size_t flags = hdr_get(block) & ~SIZE_MASK; // Keeps PREV_FREE and the heap id
+    hdr_set(block, size | flags);
+
+    Block* tail = (Block*)((char*)block_payload(block) + size);
+    hdr_set(tail, (block_bytes - size - sizeof(Block)) | heap_bits(h));
+    MM_TRACE(MM_TRACE_OPS, "Shrinking block %p to %zu bytes\n", (void*)block, size);
+    stat_event(STAT_SPLIT);
+    heap_free(h, tail);
+}
+
+/**
+ * Grow an in-use block to at least size bytes of payload by absorbing the
+ * free block that physically follows it. Returns false if that is not
+ * possible, leaving the block unchanged.
+ */
+static bool heap_expand(Heap* h, Block* block, size_t size) {
+    size_t block_bytes = block_size(block);
+    Block* next = next_block(block);
+    if (!block_is_free(next) || block_bytes + sizeof(Block) + block_size(next) < size)
+        return false;
+
+    MM_TRACE(MM_TRACE_OPS, "Growing block %p in place from %zu to %zu bytes\n", (void*)block, block_bytes, size);
+    bin_remove(h, next);
+    usage_add(h, sizeof(Block) + block_size(next));
+    if (h->walk_mark == next)
+        h->walk_mark = block;
+    block_bytes += sizeof(Block) + block_size(next);
+
+    size_t flags = hdr_get(block) & ~SIZE_MASK;
+    hdr_set(block, block_bytes | flags);
+    Block* after = next_block(block);
+    hdr_set(after, hdr_get(after) & ~FLAG_PREV_FREE);
+
+    // The absorbed block is handed out now, so it is no longer fresh
+    char* payload_end = (char*)block_payload(block) + block_bytes;
+    if (payload_end > h->fresh && (char*)next < h->fresh_end)
+        h->fresh = payload_end;
+
+    heap_shrink(h, block, size); // Give back what was not needed
+    return true;
+}
+
+/**
+ * Carve up to n consecutive in-use blocks of size bytes of payload (after
+ * PAYLOAD_SIZE) out of a single free block, storing their headers in out.
+ * Asks for room for all n first and halves the count until a free block
+ * fits. Returns how many blocks were carved, 0 if not even one fits.
+ */
+static size_t heap_carve(Heap* h, size_t size, size_t n, Block** out) {
+    size_t stride = sizeof(Block) + size;
+    size_t count = n < MM_MAX_REQUEST / stride ? n : MM_MAX_REQUEST / stride;
+    Block* block = NULL;
+    while (count && !(block = bin_take(h, count * stride - sizeof(Block))))
+        count /= 2;
+    if (!block)
+        return 0;
+
+    // The block found may hold more than was asked for
+    size_t block_bytes = block_size(block);
+    count = (block_bytes + sizeof(Block)) / stride;
+    if (count > n)
+        count = n;
+    size_t used = count * stride - sizeof(Block);
+    size_t last = size;
+    if (block_bytes >= used + MIN_BLOCK_SIZE) {
+        Block* rest = (Block*)((char*)block + sizeof(Block) + used);
+        mark_free(h, rest, block_bytes - used - sizeof(Block));
+        stat_event(STAT_SPLIT);
+        bin_insert(h, rest);
+    } else {
+        last += block_bytes - used; // Too little left over for a block
+        used = block_bytes;
+        Block* next = next_block(block);
+        hdr_set(next, hdr_get(next) & ~FLAG_PREV_FREE);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        out[i] = (Block*)((char*)block + i * stride);
+        hdr_set(out[i], (i + 1 < count ? size : last) | heap_bits(h));
+    }
+    usage_add(h, sizeof(Block) + used);
+
+    char* payload = block_payload(block);
+    char* payload_end = payload + used;
+    if (payload_end > h->fresh && payload < h->fresh_end)
+        h->fresh = payload_end;
+
+    MM_TRACE(MM_TRACE_OPS, "Carved %zu blocks of size %zu from %p\n", count, size, (void*)block);
+    return count;
+}
+
+#define CACHE_LINE 64
+
+/**
+ * Carve up to n blocks of size bytes of payload (after PAYLOAD_SIZE) for
+ * one thread as a run that covers whole cache lines: the payloads start
+ * on a line boundary and the last block is padded to the next one, so no
+ * other block's payload shares a line with the run. Every header gets
+ * tag. Like heap_carve, halves n until a free block fits; returns how
+ * many blocks were carved.
+ */
+static size_t heap_carve_run(Heap* h, size_t size, size_t n, size_t tag, Block** out) {
+    size_t stride = sizeof(Block) + size;
+    Block* block = NULL;
+    size_t span = 0;
+    for (; n; n /= 2) {
+        // Room for free blocks in front of and behind the run, whatever
+        // the free block's alignment
+        span = round_up((n - 1) * stride + size, CACHE_LINE);
+        if ((block = bin_take(h, span + CACHE_LINE + 2 * MIN_BLOCK_SIZE)))
+            break;
+    }
+    if (!block)
+        return 0;
+
+    char* start = block_payload(block);
+    char* end = start + block_size(block);
+    char* first = (char*)round_up((uintptr_t)start, CACHE_LINE);
+    while (first != start && (size_t)(first - start) < MIN_BLOCK_SIZE)
+        first += CACHE_LINE;
+    char* last = first + span;
+
+    size_t prev_free = 0;
+    if (first != start) {
+        mark_free(h, block, (size_t)(first - start) - sizeof(Block));
+        bin_insert(h, block);
+        prev_free = FLAG_PREV_FREE;
+    }
+    Block* rest = (Block*)last;
+    mark_free(h, rest, (size_t)(end - last) - sizeof(Block));
+    bin_insert(h, rest);
+    stat_event(STAT_SPLIT);
+
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (Block*)(first - sizeof(Block) + i * stride);
+        size_t bytes = i + 1 < n ? size : (size_t)(last - (char*)block_payload(out[i]));
+        hdr_set(out[i], bytes | heap_bits(h) | tag | (i ? 0 : prev_free));
+    }
+    usage_add(h, (size_t)(last - first) + sizeof(Block));
+
+    char* fresh_end = last;
+    if (fresh_end > h->fresh && first < h->fresh_end)
+        h->fresh = fresh_end;
+
+    MM_TRACE(MM_TRACE_OPS, "Carved a run of %zu blocks of size %zu at %p\n", n, size, (void*)first);
+    return n;
+}
+
+/**
+ * Move the payload of an in-use block forward to the given alignment and
+ * trim it to size bytes. The leading padding is at least a minimum block,
+ * which is freed, as is a tail big enough to be a block of its own.
+ */
+static Block* heap_align(Heap* h, Block* block, size_t alignment, size_t size) {
+    uintptr_t payload = (uintptr_t)block_payload(block);
+    uintptr_t aligned = (payload + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (aligned != payload) {
+        while (aligned - payload < MIN_BLOCK_SIZE)
+            aligned += alignment;
+
+        size_t lead = aligned - payload;
+        Block* moved = (Block*)(aligned - sizeof(Block));
+        hdr_set(moved, (block_size(block) - lead) | heap_bits(h));
+        hdr_set(block, (lead - sizeof(Block)) | (hdr_get(block) & ~SIZE_MASK));
+        MM_TRACE(MM_TRACE_OPS, "Aligning block %p to %zu bytes at %p\n", (void*)block, alignment, (void*)moved);
+        stat_event(STAT_SPLIT);
+        heap_free(h, block); // The padding merges with a free block in front of it
+        block = moved;
+    }
+    heap_shrink(h, block, size);
+    return block;
+}
+
+/**
+ * Hand a chain of blocks owned by h to it without taking its lock.
+ * Producers only ever push, and the owner detaches the whole stack at
+ * once, so a plain CAS loop is ABA-safe.
+ */
+static void remote_free_push(Heap* h, Block* first, Block* last) {
+    Block* head = atomic_load_explicit(&h->remote_free, memory_order_relaxed);
+    do {
+        as_free(last)->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&h->remote_free, &head, first,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+/**
+ * Lock a heap and merge the blocks other threads freed into it meanwhile.
+ */
+static void heap_lock(Heap* h) {
+    pthread_mutex_lock(&h->lock);
+    if (!atomic_load_explicit(&h->remote_free, memory_order_relaxed))
+        return;
+
+    Block* block = atomic_exchange_explicit(&h->remote_free, NULL, memory_order_acquire);
+    while (block) {
+        Block* next = as_free(block)->next;
+        heap_free(h, block);
+        block = next;
+    }
+}
+
+static void heap_unlock(Heap* h) {
+    pthread_mutex_unlock(&h->lock);
+}
+
+/**
+ * Start managing [mem, mem + bytes) as a new segment holding one free block.
+ */
+static void segment_add(Heap* h, void* mem, size_t bytes, bool mapped) {
+    Segment* seg = (Segment*)ALIGN((uintptr_t)mem);
+    bytes = (bytes - (size_t)((char*)seg - (char*)mem)) & ~FLAG_MASK;
+
+    seg->size = bytes;
+    seg->mapped = mapped;
+    seg->next = h->segments;
+    h->segments = seg;
+
+    char* end = (char*)seg + bytes;
+    char* lo = atomic_load_explicit(&h->lo, memory_order_relaxed);
+    if (!lo || (char*)seg < lo)
+        atomic_store_explicit(&h->lo, (char*)seg, memory_order_relaxed);
+    if (end > atomic_load_explicit(&h->hi, memory_order_relaxed))
+        atomic_store_explicit(&h->hi, end, memory_order_relaxed);
+
+    // Pages new to the process are zero-filled by the kernel. The page that
+    // held the old break may still contain stale data, so start past it.
+    h->fresh = mapped ? (char*)seg : page_align_up(mem);
+    h->fresh_end = end;
+
+    // The epilogue is a zero-sized in-use block, so coalescing stops there
+    Block* epilogue = (Block*)(end - sizeof(size_t));
+    hdr_set(epilogue, heap_bits(h));
+
+    Block* initial_block = (Block*)((char*)seg + SEGMENT_HEADER);
+    mark_free(h, initial_block, bytes - SEGMENT_OVERHEAD - sizeof(Block));
+
+    bin_insert(h, initial_block); // Add the initial block to the free lists
+}
+
+/**
+ * Append bytes of memory that start right where seg ends. The old epilogue
+ * becomes the header of a block covering the new memory, which is then
+ * freed so it merges with a free block at the old top.
+ */
+static void segment_extend(Heap* h, Segment* seg, size_t bytes) {
+    char* old_end = (char*)seg + seg->size;
+    Block* block = (Block*)(old_end - sizeof(size_t));
+
+    seg->size += bytes;
+    char* end = old_end + bytes;
+    if (end > atomic_load_explicit(&h->hi, memory_order_relaxed))
+        atomic_store_explicit(&h->hi, end, memory_order_relaxed);
+
+    if (h->fresh_end != old_end || (!seg->mapped && page_align_up(old_end) != old_end))
+        h->fresh = seg->mapped ? old_end : page_align_up(old_end);
+    h->fresh_end = end;
+
+    Block* epilogue = (Block*)(end - sizeof(size_t));
+    hdr_set(epilogue, heap_bits(h));
+    bool merge = hdr_get(block) & FLAG_PREV_FREE;
+    hdr_set(block, (bytes - sizeof(Block)) | heap_bits(h) | (merge ? FLAG_PREV_FREE : 0));
+
+    MM_TRACE(MM_TRACE_OPS, "Extending segment %p by %zu bytes\n", (void*)seg, bytes);
+    h->in_use += bytes; // The old epilogue became an in-use block of this size
+    heap_free(h, block);
+
+    // Merged with a free top block, the old footer and epilogue are now
+    // inside a payload; where that is still fresh it must read as zero
+    if (merge) {
+        for (size_t* word = (size_t*)old_end - 2; word < (size_t*)old_end; word++) {
+            if ((char*)word >= h->fresh)
+                *word = 0;
+        }
+    }
+}
+
+// NUMA placement, done with the raw system calls so there is no libnuma
+// dependency. On a machine with several memory nodes, arena id % numa_nodes
+// is the node an arena belongs to: its segments prefer that node's memory,
+// and a thread gets an arena of the node it runs on when it first
+// allocates. Frees from other nodes go back to the owning arena as usual.
+// The main heap grows with sbrk and keeps first-touch placement.
+#define MPOL_PREFERRED_MODE 1 // MPOL_PREFERRED from <numaif.h>
+
+/**
+ * Count the memory nodes from the highest id in
+ * /sys/devices/system/node/possible (such as "0-3"); 1 if unknown.
+ */
+static unsigned numa_node_count(void) {
+    char buf[64];
+    int fd = open("/sys/devices/system/node/possible", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 1;
+
+    unsigned last = 0;
+    for (ssize_t i = 0; i < n; i++) {
+        if (buf[i] >= '0' && buf[i] <= '9')
+            last = last * 10 + (unsigned)(buf[i] - '0');
+        else if (buf[i] != '\n')
+            last = 0;
+    }
+    return last + 1;
+}
+
+/**
+ * The node the calling thread runs on, 0 if it cannot be told.
+ */
+static unsigned numa_current_node(void) {
+    unsigned cpu, node = 0;
+#ifdef SYS_getcpu
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+        node = 0;
+#endif
+    return node % numa_nodes;
+}
+
+/**
+ * Make new memory of an arena prefer its node. It is only a preference,
+ * so a full node spills over instead of failing allocations.
+ */
+static void numa_bind(Heap* h, void* mem, size_t bytes) {
+    if (numa_nodes <= 1 || h->id == 0 || h->id >= MM_MAX_ARENAS)
+        return;
+#ifdef SYS_mbind
+    unsigned long mask = 1UL << (h->id % numa_nodes);
+    if (syscall(SYS_mbind, mem, bytes, MPOL_PREFERRED_MODE, &mask, sizeof(mask) * 8, 0) != 0)
+        MM_TRACE(MM_TRACE_ERROR, "Warning: Unable to bind arena %u to node %u.\n", h->id, h->id % numa_nodes);
+#else
+    (void)mem;
+    (void)bytes;
+#endif
+}
+
+/**
+ * Map bytes, a multiple of the huge page size huge, aligned to huge. Uses
+ * hugetlbfs pages when the system has them reserved and otherwise asks for
+ * transparent huge pages, which the kernel may still decline; either way
+ * the memory is usable. Returns MAP_FAILED if nothing can be mapped.
+ */
+static void* huge_map(size_t bytes, size_t huge) {
+#ifdef MAP_HUGETLB
+    int log2 = __builtin_ctzll(huge);
+    void* mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (log2 << MAP_HUGE_SHIFT), -1, 0);
+    if (mem != MAP_FAILED)
+        return mem;
+#endif
+
+    // Over-map, then cut the range down to an aligned one
+    char* raw = mmap(NULL, bytes + huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return MAP_FAILED;
+    char* start = (char*)round_up((uintptr_t)raw, huge);
+    if (start > raw)
+        munmap(raw, (size_t)(start - raw));
+    if (raw + huge > start)
+        munmap(start + bytes, (size_t)(raw + huge - start));
+#ifdef MADV_HUGEPAGE
+    madvise(start, bytes, MADV_HUGEPAGE);
+#endif
+    return start;
+}
+
+/**
+ * Add memory for at least one block of size bytes. The main heap extends
+ * the program break; other arenas, or the main heap once sbrk fails, map
+ * memory right after their newest segment when the kernel allows it.
+ */
+static bool heap_grow(Heap* h, size_t size) {
+    if (size > SIZE_MAX / 2)
+        return false;
+
+    size_t bytes = size + sizeof(Block) + SEGMENT_OVERHEAD + ALIGNMENT;
+    if (bytes < MM_GROW_MIN)
+        bytes = MM_GROW_MIN;
+    bytes = round_up(bytes, h->page);
+
+    Segment* top = h->segments;
+    char* top_end = top ? (char*)top + top->size : NULL;
+
+    if (h->use_sbrk) {
+        void* mem = sbrk((intptr_t)bytes);
+        if (mem != (void*)-1) {
+            if (top && !top->mapped && (char*)mem == top_end)
+                segment_extend(h, top, bytes);
+            else
+                segment_add(h, mem, bytes, false);
+            return true;
+        }
+        MM_TRACE(MM_TRACE_ERROR, "Error: Unable to grow heap using sbrk, trying mmap.\n");
+    }
+
+    void* mem = h->page > page_size() ? huge_map(bytes, h->page)
+                                      : mmap(top_end, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        MM_TRACE(MM_TRACE_ERROR, "Error: Unable to grow heap by %zu bytes.\n", bytes);
+        return false;
+    }
+    numa_bind(h, mem, bytes);
+    if (top && top->mapped && (char*)mem == top_end)
+        segment_extend(h, top, bytes);
+    else
+        segment_add(h, mem, bytes, true);
+    return true;
+}
+
+/**
+ * Forget all memory of a heap, unmapping the segments that came from mmap.
+ */
+static void heap_reset(Heap* h) {
+    Segment* seg = h->segments;
+    while (seg) {
+        Segment* next = seg->next;
+        if (seg->mapped)
+            munmap(seg, seg->size);
+        else if ((char*)seg + seg->size == sbrk(0))
+            sbrk(-(intptr_t)seg->size); // Nobody moved the break since
+        seg = next;
+    }
+
+    h->segments = NULL;
+    atomic_store_explicit(&h->lo, NULL, memory_order_relaxed);
+    atomic_store_explicit(&h->hi, NULL, memory_order_relaxed);
+    h->fresh = h->fresh_end = NULL;
+    memset(h->bins, 0, sizeof(h->bins));
+    h->bin_map = 0;
+    h->tree = NULL;
+    atomic_store_explicit(&h->remote_free, NULL, memory_order_relaxed);
+    h->in_use = h->peak = 0;
+}
+
+/**
+ * Unmap a mapped segment that holds a single free block, which a paused
+ * walk is not in. The heap bounds shrink to the remaining segments.
+ * Returns the number of bytes released. Callers hold the heap's lock.
+ */
+static size_t segment_release(Heap* h, Segment** link) {
+    Segment* seg = *link;
+    char* end = (char*)seg + seg->size;
+    Block* block = (Block*)((char*)seg + SEGMENT_HEADER);
+    if (!seg->mapped || !block_is_free(block) || (char*)next_block(block) != end - sizeof(size_t) ||
+        ((char*)h->walk_mark >= (char*)seg && (char*)h->walk_mark < end))
+        return 0;
+
+    while (atomic_load(&central_poppers))
+        sched_yield(); // A pop may still read a block in the segment
+    MM_TRACE(MM_TRACE_OPS, "Releasing free segment %p of %zu bytes\n", (void*)seg, seg->size);
+    bin_remove(h, block);
+    *link = seg->next;
+    if (h->fresh_end == end)
+        h->fresh = h->fresh_end = NULL;
+
+    // Frees of blocks in other segments read the bounds without the lock;
+    // both still cover those segments at every step
+    char* lo = NULL;
+    char* hi = NULL;
+    for (Segment* s = h->segments; s; s = s->next) {
+        if (!lo || (char*)s < lo)
+            lo = (char*)s;
+        if ((char*)s + s->size > hi)
+            hi = (char*)s + s->size;
+    }
+    atomic_store_explicit(&h->lo, lo, memory_order_relaxed);
+    atomic_store_explicit(&h->hi, hi, memory_order_relaxed);
+
+    size_t bytes = seg->size;
+    munmap(seg, bytes);
+    return bytes;
+}
+
+/**
+ * Give back the end of every segment that ends in a free block, keeping
+ * pad bytes of that block, unmap the mapped segments other than the first
+ * that became entirely free, and decommit the interior pages of all large
+ * free blocks. The break only moves down if nobody has moved it since.
+ * Returns the number of bytes released or decommitted. Callers hold the
+ * heap's lock.
+ */
+static size_t heap_trim(Heap* h, size_t pad) {
+    size_t released = 0;
+    pad = pad < MIN_PAYLOAD ? MIN_PAYLOAD : ALIGN(pad);
+
+    for (Segment** link = &h->segments; *link;) {
+        Segment* seg = *link;
+        if (seg->next) { // The first segment, last in the list, is kept
+            size_t bytes = segment_release(h, link);
+            if (bytes) {
+                released += bytes;
+                continue;
+            }
+        }
+        link = &seg->next;
+
+        char* end = (char*)seg + seg->size;
+        Block* epilogue = (Block*)(end - sizeof(size_t));
+        if (!(hdr_get(epilogue) & FLAG_PREV_FREE))
+            continue;
+
+        Block* last = prev_block(epilogue);
+        char* keep = (char*)round_up((uintptr_t)block_payload(last) + pad + sizeof(size_t), h->page);
+        if (keep >= end || (!seg->mapped && (void*)end != sbrk(0)))
+            continue;
+
+        size_t bytes = (size_t)(end - keep);
+        while (atomic_load(&central_poppers))
+            sched_yield(); // A pop may still read a block in [keep, end)
+        if (seg->mapped ? munmap(keep, bytes) != 0 : sbrk(-(intptr_t)bytes) == (void*)-1)
+            continue;
+        MM_TRACE(MM_TRACE_OPS, "Trimming %zu bytes off segment %p\n", bytes, (void*)seg);
+
+        bin_remove(h, last);
+        seg->size -= bytes;
+        if (h->walk_mark == epilogue)
+            h->walk_mark = (Block*)(keep - sizeof(size_t));
+        hdr_set((Block*)(keep - sizeof(size_t)), heap_bits(h));
+        mark_free(h, last, (size_t)(keep - sizeof(size_t) - (char*)block_payload(last)));
+        bin_insert(h, last);
+
+        if (h->fresh_end == end) {
+            h->fresh_end = keep;
+            if (h->fresh > keep)
+                h->fresh = keep;
+        }
+        if (atomic_load_explicit(&h->hi, memory_order_relaxed) == end) {
+            // Publish the new end once: frees of blocks in other segments
+            // read it without the lock and must never see it too low
+            char* hi = keep;
+            for (Segment* s = h->segments; s; s = s->next) {
+                if ((char*)s + s->size > hi)
+                    hi = (char*)s + s->size;
+            }
+            atomic_store_explicit(&h->hi, hi, memory_order_relaxed);
+        }
+        released += bytes;
+    }
+
+    return released + tree_decommit(h, h->tree);
+}
+
+#define HEAP_MAPPING_SIZE page_round(sizeof(Heap))
+
+/**
+ * Map a new heap with id and a first segment of size bytes.
+ */
+static Heap* heap_create(unsigned id, size_t size) {
+    Heap* h = mmap(NULL, HEAP_MAPPING_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (h == MAP_FAILED) {
+        MM_TRACE(MM_TRACE_ERROR, "Error: Unable to map heap %u.\n", id);
+        return NULL;
+    }
+
+    pthread_mutex_init(&h->lock, NULL);
+    h->id = id;
+    h->page = atomic_load_explicit(&huge_page_size, memory_order_relaxed);
+    if (!h->page)
+        h->page = page_size();
+    if (!heap_grow(h, size)) {
+        munmap(h, HEAP_MAPPING_SIZE);
+        return NULL;
+    }
+    return h;
+}
+
+/**
+ * Choose the arena for a thread that has none yet. Threads are assigned
+ * round-robin among the arenas of their node; arenas other than the main
+ * one are created on first use.
+ */
+static Heap* arena_assign(void) {
+    if (arena_count <= 1)
+        return &main_heap;
+
+    unsigned ticket = atomic_fetch_add_explicit(&next_arena, 1, memory_order_relaxed);
+    unsigned id = ticket % arena_count;
+    if (numa_nodes > 1) {
+        // Arenas node, node + numa_nodes, ... below arena_count
+        unsigned node = numa_current_node();
+        id = node + numa_nodes * (ticket % ((arena_count - node + numa_nodes - 1) / numa_nodes));
+    }
+    Heap* h = atomic_load_explicit(&heaps[id], memory_order_acquire);
+    if (h)
+        return h;
+
+    pthread_mutex_lock(&arenas_lock);
+    h = atomic_load_explicit(&heaps[id], memory_order_relaxed);
+    if (!h && (h = heap_create(id, arena_size)))
+        atomic_store_explicit(&heaps[id], h, memory_order_release);
+    pthread_mutex_unlock(&arenas_lock);
+
+    return h ? h : &main_heap;
+}
+
+/**
+ * Unmap every arena except the main one. Callers hold arenas_lock.
+ */
+static void arenas_release(void) {
+    for (unsigned id = 1; id < MM_MAX_ARENAS; id++) {
+        Heap* h = atomic_exchange_explicit(&heaps[id], NULL, memory_order_acq_rel);
+        if (h) {
+            heap_reset(h);
+            pthread_mutex_destroy(&h->lock);
+            munmap(h, HEAP_MAPPING_SIZE);
+        }
+    }
+}
+
+/**
+ * Initialize with the default size on first use, so programs that never
+ * call mm_init (such as those running under the preload library) work.
+ */
+static void heap_init_lazy(void) {
+    pthread_mutex_lock(&init_lock);
+    if (!atomic_load_explicit(&heaps[0], memory_order_acquire))
+        mm_init(MM_DEFAULT_HEAP_SIZE);
+    pthread_mutex_unlock(&init_lock);
+}
+
+static pthread_rwlock_t trace_lock; // Guards the trace file, see below
+
+// Fork handlers: every allocator lock is held across fork(), so the child
+// never inherits a heap in the middle of an update by another thread.
+static void fork_prepare(void) {
+    pthread_mutex_lock(&walk_lock);
+    pthread_mutex_lock(&init_lock);
+    pthread_mutex_lock(&arenas_lock);
+    for (unsigned id = 0; id < MM_MAX_HEAPS; id++) {
+        Heap* h = atomic_load_explicit(&heaps[id], memory_order_acquire);
+        if (h)
+            pthread_mutex_lock(&h->lock);
+    }
+    pthread_mutex_lock(&sample_lock);
+    pthread_mutex_lock(&stats_lock);
+    pthread_rwlock_wrlock(&trace_lock);
+}
+
+static void fork_release(void) {
+    pthread_rwlock_unlock(&trace_lock);
+    pthread_mutex_unlock(&stats_lock);
+    pthread_mutex_unlock(&sample_lock);
+    for (unsigned id = MM_MAX_HEAPS; id-- > 0;) {
+        Heap* h = atomic_load_explicit(&heaps[id], memory_order_relaxed);
+        if (h)
+            pthread_mutex_unlock(&h->lock);
+    }
+    pthread_mutex_unlock(&arenas_lock);
+    pthread_mutex_unlock(&init_lock);
+    pthread_mutex_unlock(&walk_lock);
+}
+
+static void fork_child(void) {
+    // An rwlock records its writer's thread id, which the child does not
+    // share; write-lock a fresh one so that fork_release can unlock it
+    pthread_rwlock_init(&trace_lock, NULL);
+    pthread_rwlock_wrlock(&trace_lock);
+    fork_release();
+
+    // Pops that other threads had in flight will never finish here
+    atomic_store(&central_poppers, 0);
+
+    // The decommit thread was not copied into the child
+    pthread_mutex_init(&decommit_lock, NULL);
+    decommit_running = false;
+    decommit_interval_ms = 0;
+}
+
+__attribute__((constructor)) static void fork_handlers_install(void) {
+    pthread_atfork(fork_prepare, fork_release, fork_child);
+}
+
+// Allocation trace: while a trace is on, every public call appends a
+// record to a buffer of the calling thread, mapped on first use, which is
+// written to the trace file whenever it fills up. trace_lock keeps the file
+// open while a buffer is written; records of an earlier trace are dropped.
+#define TRACE_BUFFER_RECORDS 4096
+
+typedef struct TraceBuffer {
+    unsigned generation;  // trace_generation the records belong to
+    unsigned thread;      // Thread number in the records
+    size_t used;
+    struct mm_trace_record records[TRACE_BUFFER_RECORDS];
+} TraceBuffer;
+
+static __thread TraceBuffer* trace_buffer __attribute__((tls_model("initial-exec")));
+static atomic_bool trace_on;
+static atomic_uint trace_generation;
+static atomic_uint trace_threads;   // Thread numbers handed out
+static int trace_fd = -1;
+static _Atomic uint64_t trace_start_ns;
+static pthread_rwlock_t trace_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static inline bool tracing(void) {
+    return __builtin_expect(atomic_load_explicit(&trace_on, memory_order_acquire), 0);
+}
+
+static inline uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void trace_flush(TraceBuffer* tb) {
+    pthread_rwlock_rdlock(&trace_lock);
+    if (trace_fd >= 0 && tb->generation == atomic_load_explicit(&trace_generation, memory_order_relaxed)) {
+        const char* data = (const char*)tb->records;
+        size_t left = tb->used * sizeof(struct mm_trace_record);
+        while (left) {
+            ssize_t n = write(trace_fd, data, left);
+            if (n <= 0)
+                break;
+            data += n;
+            left -= (size_t)n;
+        }
+    }
+    pthread_rwlock_unlock(&trace_lock);
+    tb->used = 0;
+}
+
+static void trace_record(unsigned op, void* ptr, void* old, size_t size) {
+    TraceBuffer* tb = trace_buffer;
+    if (!tb) {
+        tb = mmap(NULL, sizeof(TraceBuffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (tb == MAP_FAILED)
+            return;
+        tb->thread = atomic_fetch_add_explicit(&trace_threads, 1, memory_order_relaxed);
+        trace_buffer = tb;
+    }
+    if (tb->used == 0)
+        tb->generation = atomic_load_explicit(&trace_generation, memory_order_relaxed);
+
+    struct mm_trace_record* r = &tb->records[tb->used++];
+    r->time_ns = clock_ns() - atomic_load_explicit(&trace_start_ns, memory_order_relaxed);
+    r->ptr = (uintptr_t)ptr;
+    r->old = (uintptr_t)old;
+    r->size = size;
+    r->thread = tb->thread;
+    r->op = op;
+    if (tb->used == TRACE_BUFFER_RECORDS)
+        trace_flush(tb);
+}
+
+// Heap profile: each thread counts down the bytes it allocates, and the
+// allocation that takes the count below zero is sampled. Intervals are
+// drawn from an exponential distribution with a mean of sample_rate bytes,
+// so a block of size bytes is sampled with probability 1 - e^(-size/rate)
+// and pprof can scale the samples back up. A sampled block carries
+// FLAG_SAMPLED and its allocation stack sits in a hash table, mapped apart
+// from the heaps, until the block is freed. Unsampled calls only pay the
+// decrement; with sampling off the count is rearmed every
+// SAMPLE_RECHECK bytes to notice it being turned on.
+#define SAMPLE_DEPTH 30                     // Frames kept per sample
+#define SAMPLE_SLACK 4                      // Extra frames captured to cut off the allocator's own
+#define SAMPLE_RECHECK ((intptr_t)1 << 20)
+#define SAMPLE_TABLE_MIN 1024                // Initial slots; the table doubles at half full
+
+typedef struct Sample {
+    void* ptr;                 // Payload address; NULL for an empty slot
+    size_t size;               // Bytes requested
+    unsigned heap;             // Owning heap id, MM_MAX_HEAPS for an mmapped block
+    unsigned depth;
+    void* stack[SAMPLE_DEPTH]; // Return addresses, innermost first
+} Sample;
+
+static atomic_size_t sample_rate;   // Mean bytes between samples; 0 = off
+static size_t sample_period;        // Last nonzero sample_rate, for the profile header
+static Sample* sample_table;        // Open addressing with linear probing
+static size_t sample_slots;
+static size_t sample_count;
+static __thread intptr_t sample_left __attribute__((tls_model("initial-exec")));
+static __thread uint64_t sample_rng __attribute__((tls_model("initial-exec")));
+static __thread bool sample_busy __attribute__((tls_model("initial-exec"))); // backtrace may allocate
+
+/**
+ * Count an allocation of size bytes against the calling thread's sample
+ * interval; true when the block is to be sampled.
+ */
+static inline bool sample_due(size_t size) {
+    return __builtin_expect((sample_left -= (intptr_t)size) < 0, 0);
+}
+
+/**
+ * Draw the bytes to the next sample: -ln(u) * rate for u uniform in
+ * (0, 1], with ln computed from the exponent and a short series so no
+ * libm is needed.
+ */
+static intptr_t sample_interval(size_t rate) {
+    if (!sample_rng)
+        sample_rng = clock_ns() ^ (uintptr_t)&sample_rng;
+    sample_rng ^= sample_rng << 13; // xorshift64
+    sample_rng ^= sample_rng >> 7;
+    sample_rng ^= sample_rng << 17;
+
+    uint64_t r = (sample_rng >> 11) | 1; // 53 random bits, never 0
+    int e = 63 - __builtin_clzll(r);
+    double m = (double)r / (double)((uint64_t)1 << e); // In [1, 2)
+    double t = (m - 1) / (m + 1), t2 = t * t;
+    double ln_m = 2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 / 7)));
+    double x = (53 - e) * 0.6931471805599453 - ln_m; // -ln(r / 2^53)
+    return (intptr_t)(x * (double)rate) + 1;
+}
+
+static inline size_t sample_hash(const void* ptr) {
+    return (size_t)(((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ull);
+}
+
+/**
+ * Put a sample into a table of slots slots. Callers hold sample_lock.
+ */
+static void sample_place(Sample* table, size_t slots, const Sample* sample) {
+    size_t i = sample_hash(sample->ptr) & (slots - 1);
+    while (table[i].ptr)
+        i = (i + 1) & (slots - 1);
+    table[i] = *sample;
+}
+
+/**
+ * Move the samples into a new table of slots slots, leaving out those of
+ * heaps [drop_first, drop_end). Returns false if no memory was available.
+ */
+static bool sample_rebuild(size_t slots, unsigned drop_first, unsigned drop_end) {
+    Sample* table = mmap(NULL, slots * sizeof(Sample), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED)
+        return false;
+
+    sample_count = 0;
+    for (size_t i = 0; i < sample_slots; i++) {
+        Sample* s = &sample_table[i];
+        if (s->ptr && (s->heap < drop_first || s->heap >= drop_end)) {
+            sample_place(table, slots, s);
+            sample_count++;
+        }
+    }
+    if (sample_table)
+        munmap(sample_table, sample_slots * sizeof(Sample));
+    sample_table = table;
+    sample_slots = slots;
+    return true;
+}
+
+/**
+ * Forget the samples of heaps [first, end), whose memory is going away.
+ */
+static void sample_drop(unsigned first, unsigned end) {
+    pthread_mutex_lock(&sample_lock);
+    if (sample_count)
+        sample_rebuild(sample_slots, first, end);
+    pthread_mutex_unlock(&sample_lock);
+}
+
+/**
+ * Take the sample of the block at ptr out of the table, shifting later
+ * entries of its probe run back so no tombstones are needed.
+ */
+static void sample_remove(void* ptr) {
+    pthread_mutex_lock(&sample_lock);
+    size_t mask = sample_slots - 1;
+    size_t i = sample_table ? sample_hash(ptr) & mask : 0;
+    while (sample_table && sample_table[i].ptr && sample_table[i].ptr != ptr)
+        i = (i + 1) & mask;
+    if (sample_table && sample_table[i].ptr) {
+        sample_count--;
+        for (size_t j = (i + 1) & mask; sample_table[j].ptr; j = (j + 1) & mask) {
+            size_t home = sample_hash(sample_table[j].ptr) & mask;
+            if (((j - home) & mask) >= ((j - i) & mask)) { // j can move back to i
+                sample_table[i] = sample_table[j];
+                i = j;
+            }
+        }
+        sample_table[i].ptr = NULL;
+    }
+    pthread_mutex_unlock(&sample_lock);
+}
+
+/**
+ * Set or clear FLAG_SAMPLED. Other threads update the flags of in-use
+ * heap blocks under the heap lock, so take it; an mmapped block's header
+ * is only touched by its owner.
+ */
+static void sample_flag(Block* block, bool on) {
+    Heap* owner = NULL;
+    if (!(hdr_get(block) & FLAG_MMAPPED))
+        owner = atomic_load_explicit(&heaps[block_heap_id(block)], memory_order_acquire);
+    if (owner)
+        heap_lock(owner);
+    size_t hdr = hdr_get(block);
+    hdr_set(block, on ? hdr | FLAG_SAMPLED : hdr & ~FLAG_SAMPLED);
+    if (owner)
+        heap_unlock(owner);
+}
+
+/**
+ * Called when an allocation of size bytes ran out the sample interval:
+ * draw the next interval and record ptr with the caller's stack.
+ */
+__attribute__((noinline, cold)) static void sample_take(void* ptr, size_t size) {
+    size_t rate = atomic_load_explicit(&sample_rate, memory_order_relaxed);
+    sample_left = rate ? sample_interval(rate) : SAMPLE_RECHECK;
+    if (!rate || !ptr || sample_busy)
+        return;
+
+    sample_busy = true;
+    // The stack starts in the caller of the public entry point, whose
+    // return address follows this function's own
+    void* frames[SAMPLE_DEPTH + SAMPLE_SLACK];
+    int total = backtrace(frames, SAMPLE_DEPTH + SAMPLE_SLACK);
+    int skip = 0;
+    while (skip < total && skip < SAMPLE_SLACK && frames[skip] != __builtin_return_address(0))
+        skip++;
+    skip = skip < total && skip < SAMPLE_SLACK ? skip + 1 : 0;
+    int depth = total - skip < SAMPLE_DEPTH ? total - skip : SAMPLE_DEPTH;
+
+    Block* block = (Block*)((char*)ptr - sizeof(Block));
+    Sample sample = { ptr, size, MM_MAX_HEAPS, (unsigned)depth, { 0 } };
+    if (!(hdr_get(block) & FLAG_MMAPPED))
+        sample.heap = block_heap_id(block);
+    memcpy(sample.stack, frames + skip, (size_t)depth * sizeof(void*));
+
+    pthread_mutex_lock(&sample_lock);
+    bool room = (sample_count + 1) * 2 <= sample_slots ||
+                sample_rebuild(sample_slots ? sample_slots * 2 : SAMPLE_TABLE_MIN, 0, 0);
+    if (room) {
+        sample_place(sample_table, sample_slots, &sample);
+        sample_count++;
+    }
+    pthread_mutex_unlock(&sample_lock);
+    if (room)
+        sample_flag(block, true);
+    sample_busy = false;
+}
+
+/**
+ * Drop the sample of a block that is being freed or resized.
+ */
+__attribute__((noinline, cold)) static void sample_forget(Block* block) {
+    sample_flag(block, false);
+    sample_remove(block_payload(block));
+}
+
+// Per-thread cache of small blocks, one LIFO list per small size class.
+// Cached blocks still count as in use for their heap; they move to and
+// from it in batches so a lock is taken once per batch, not per call.
+#define TCACHE_BINS SMALL_BIN_COUNT
+#define TCACHE_MAX_SIZE SMALL_BIN_MAX
+#define TCACHE_FILL 32  // Cached blocks per size class before flushing
+#define TCACHE_BATCH 16 // Largest number of blocks moved by one refill/flush
+#define QUARANTINE_MAX 128 // Largest per-thread quarantine (hardened builds)
+
+typedef struct ThreadCache {
+    Block* bins[TCACHE_BINS];     // Chained through FreeBlock.next
+    uint8_t count[TCACHE_BINS];   // Blocks cached per size class
+    uint8_t refill[TCACHE_BINS];  // Next refill batch; grows from 1 (slow start)
+    Heap* heap;                   // Arena this thread allocates from
+    unsigned epoch;               // heap_epoch the cached blocks belong to
+    bool registered;              // Thread-exit destructor installed
+    size_t tag;                   // Header bits of blocks carved for this thread
+#if MM_HARDENED
+    Block* quarantine[QUARANTINE_MAX]; // Ring of freed blocks waiting to be reused
+    unsigned quarantine_next;          // Slot the next freed block goes to
+#endif
+} ThreadCache;
+
+// With cache isolation on, refills carve each thread's small blocks as
+// cache-line aligned runs, and a thread caches only the blocks carved for
+// it: the others go back to their arena. Objects of different threads can
+// then share a cache line only if their threads' tags collide.
+static atomic_bool cache_isolation;
+
+// Initial-exec TLS: no lazy TLS allocation (which may call malloc) when
+// built into a shared library
+static __thread ThreadCache tcache __attribute__((tls_model("initial-exec")));
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static void tcache_flush_all(ThreadCache* tc);
+
+// Central free lists. A thread cache that overflows hands a batch of
+// TCACHE_BATCH blocks of the class to a lock-free stack for that class, and
+// a cache that runs dry takes a whole batch back with one CAS before it
+// goes to its arena's lock. Batches are chained through the third payload
+// word of their first block; the first word chains the blocks in a batch.
+// The stack head carries a tag in its top 16 bits that every push and pop
+// bumps, so a pop that read a stale link fails its CAS (no ABA). A pop may
+// read a block another thread popped and freed meanwhile, so heap_trim
+// waits for pops in flight before it unmaps any memory.
+#define CENTRAL_MAX 64 // Batches per class; further overflow goes to the heaps
+#define CENTRAL_TAG_SHIFT 48
+#define CENTRAL_PTR_MASK (((uint64_t)1 << CENTRAL_TAG_SHIFT) - 1)
+
+typedef struct Central {
+    _Atomic uint64_t head; // Newest batch | tag << CENTRAL_TAG_SHIFT
+    atomic_int batches;    // Approximate depth
+} __attribute__((aligned(CACHE_LINE))) Central;
+
+static Central central[TCACHE_BINS];
+
+static inline Block** batch_link(Block* first) {
+    return (Block**)block_payload(first) + 2;
+}
+
+/**
+ * Read the link of a batch that may have been popped and handed out
+ * meanwhile, racing with its new owner's writes. central_pop discards the
+ * value in that case, so the race is benign; it is kept out of TSan's
+ * sight rather than turning every payload write into an atomic one.
+ */
+__attribute__((no_sanitize_thread, noinline)) static Block* batch_peek(Block* first) {
+    return *(Block* volatile*)batch_link(first);
+}
+
+/**
+ * Move the oldest TCACHE_BATCH blocks of an overflowing bin to the central
+ * stack. Returns false, leaving the bin alone, if the stack is full or
+ * blocks must stay with their thread.
+ */
+static bool central_push(ThreadCache* tc, int bin) {
+    Central* c = &central[bin];
+    if (atomic_load_explicit(&cache_isolation, memory_order_relaxed) ||
+        atomic_load_explicit(&c->batches, memory_order_relaxed) >= CENTRAL_MAX)
+        return false;
+
+    Block** link = &tc->bins[bin];
+    for (unsigned i = TCACHE_BATCH; i < tc->count[bin]; i++)
+        link = &as_free(*link)->next;
+    Block* first = *link;
+    *link = NULL;
+    tc->count[bin] -= TCACHE_BATCH;
+
+    uint64_t head = atomic_load_explicit(&c->head, memory_order_relaxed);
+    uint64_t top;
+    do {
+        __atomic_store_n(batch_link(first), (Block*)(uintptr_t)(head & CENTRAL_PTR_MASK), __ATOMIC_RELAXED);
+        top = (uintptr_t)first | ((head + ((uint64_t)1 << CENTRAL_TAG_SHIFT)) & ~CENTRAL_PTR_MASK);
+    } while (!atomic_compare_exchange_weak_explicit(&c->head, &head, top, memory_order_release,
+                                                    memory_order_relaxed));
+    atomic_fetch_add_explicit(&c->batches, 1, memory_order_relaxed);
+    return true;
+}
+
+/**
+ * Take the newest batch of a class, a NULL-terminated chain of
+ * TCACHE_BATCH blocks, off the central stack.
+ */
+static Block* central_pop(int bin) {
+    Central* c = &central[bin];
+    if (!(atomic_load_explicit(&c->head, memory_order_relaxed) & CENTRAL_PTR_MASK))
+        return NULL;
+
+    atomic_fetch_add(&central_poppers, 1);
+    uint64_t head = atomic_load(&c->head);
+    Block* first;
+    uint64_t top;
+    do {
+        first = (Block*)(uintptr_t)(head & CENTRAL_PTR_MASK);
+        if (!first)
+            break;
+        // first may already be popped and in use; then the tag has moved
+        // on and the CAS fails, whatever this read returned
+        Block* next = batch_peek(first);
+        top = (uintptr_t)next | ((head + ((uint64_t)1 << CENTRAL_TAG_SHIFT)) & ~CENTRAL_PTR_MASK);
+    } while (!atomic_compare_exchange_weak_explicit(&c->head, &head, top, memory_order_acquire,
+                                                    memory_order_acquire));
+    atomic_fetch_sub(&central_poppers, 1);
+    if (first)
+        atomic_fetch_sub_explicit(&c->batches, 1, memory_order_relaxed);
+    return first;
+}
+
+/**
+ * Forget every central batch: their memory went away with the heaps.
+ */
+static void central_reset(void) {
+    for (int bin = 0; bin < TCACHE_BINS; bin++) {
+        uint64_t head = atomic_load_explicit(&central[bin].head, memory_order_relaxed);
+        atomic_store_explicit(&central[bin].head, head & ~CENTRAL_PTR_MASK, memory_order_relaxed);
+        atomic_store_explicit(&central[bin].batches, 0, memory_order_relaxed);
+    }
+}
+
+/**
+ * Make the calling thread's counters visible to mm_stats.
+ */
+static void stats_register(void) {
+    pthread_mutex_lock(&stats_lock);
+    thread_stats.next = stats_threads;
+    stats_threads = &thread_stats;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Fold the counters of an exiting thread into stats_retired.
+ */
+static void stats_retire(void) {
+    pthread_mutex_lock(&stats_lock);
+    for (ThreadStats** link = &stats_threads; *link; link = &(*link)->next) {
+        if (*link == &thread_stats) {
+            *link = thread_stats.next;
+            break;
+        }
+    }
+    for (int i = 0; i < STAT_COUNT; i++)
+        stat_add(&stats_retired.events[i], atomic_load_explicit(&thread_stats.events[i], memory_order_relaxed));
+    for (int i = 0; i < MM_STATS_SIZE_CLASSES; i++)
+        stat_add(&stats_retired.sizes[i], atomic_load_explicit(&thread_stats.sizes[i], memory_order_relaxed));
+    memset(&thread_stats, 0, sizeof(thread_stats));
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void quarantine_drain(ThreadCache* tc);
+
+static void tcache_thread_exit(void* arg) {
+    quarantine_drain((ThreadCache*)arg);
+    tcache_flush_all((ThreadCache*)arg);
+    stats_retire();
+    if (trace_buffer) {
+        if (trace_buffer->used)
+            trace_flush(trace_buffer);
+        munmap(trace_buffer, sizeof(TraceBuffer));
+        trace_buffer = NULL;
+    }
+}
+
+static void tcache_make_key(void) {
+    pthread_key_create(&tcache_key, tcache_thread_exit);
+}
+
+/**
+ * Get the calling thread's cache, dropping its contents and arena if the
+ * heap was re-initialized since they were cached.
+ */
+static ThreadCache* tcache_get(void) {
+    ThreadCache* tc = &tcache;
+    unsigned epoch = atomic_load_explicit(&heap_epoch, memory_order_acquire);
+    if (tc->epoch != epoch || !tc->heap) {
+        if (!atomic_load_explicit(&heaps[0], memory_order_acquire)) {
+            heap_init_lazy();
+            epoch = atomic_load_explicit(&heap_epoch, memory_order_acquire);
+        }
+        memset(tc->bins, 0, sizeof(tc->bins));
+        memset(tc->count, 0, sizeof(tc->count));
+#if MM_HARDENED
+        memset(tc->quarantine, 0, sizeof(tc->quarantine));
+#endif
+        tc->epoch = epoch;
+        tc->heap = arena_assign();
+    }
+    if (!tc->registered) {
+        pthread_once(&tcache_key_once, tcache_make_key);
+        pthread_setspecific(tcache_key, tc);
+        stats_register();
+        uint64_t mix = (uintptr_t)tc * 0x9E3779B97F4A7C15ull;
+        tc->tag = (size_t)(1 + (mix >> 32) % 255) << THREAD_TAG_SHIFT;
+        tc->registered = true;
+    }
+    return tc;
+}
+
+/**
+ * Free a chain of in-use blocks. Blocks of the thread's own arena are merged
+ * under one lock; the rest are handed to their owners' remote-free stacks.
+ */
+static void free_chain(Heap* local, Block* block) {
+    Block* remote_first[MM_MAX_ARENAS] = { NULL };
+    Block* remote_last[MM_MAX_ARENAS];
+    bool locked = false;
+
+    while (block) {
+        Block* next = as_free(block)->next;
+        unsigned id = block_heap_id(block);
+        if (id == local->id) {
+            if (!locked) {
+                heap_lock(local);
+                locked = true;
+            }
+            heap_free(local, block);
+        } else {
+            if (!remote_first[id])
+                remote_last[id] = block;
+            as_free(block)->next = remote_first[id];
+            remote_first[id] = block;
+        }
+        block = next;
+    }
+    if (locked)
+        heap_unlock(local);
+
+    for (unsigned id = 0; id < MM_MAX_ARENAS; id++) {
+        if (remote_first[id])
+            remote_free_push(atomic_load_explicit(&heaps[id], memory_order_acquire),
+                             remote_first[id], remote_last[id]);
+    }
+}
+
+/**
+ * Move all but the newest keep blocks of a bin back to their heaps.
+ */
+static void tcache_flush(ThreadCache* tc, int bin, unsigned keep) {
+    Block** link = &tc->bins[bin];
+    for (unsigned i = 0; i < keep && *link; i++)
+        link = &as_free(*link)->next;
+
+    Block* block = *link;
+    *link = NULL;
+    tc->count[bin] = keep;
+    free_chain(tc->heap, block);
+}
+
+static void tcache_flush_all(ThreadCache* tc) {
+    if (tc->epoch != atomic_load_explicit(&heap_epoch, memory_order_acquire))
+        return; // Blocks of a heap that no longer exists
+    for (int bin = 0; bin < TCACHE_BINS; bin++) {
+        if (tc->bins[bin])
+            tcache_flush(tc, bin, 0);
+    }
+}
+
+/**
+ * Pop a cached block for an aligned small size, refilling the bin from the
+ * thread's arena when it is empty.
+ */
+static Block* tcache_alloc(ThreadCache* tc, size_t size) {
+    int bin = size_to_bin(size);
+    Block* block = tc->bins[bin];
+    if (block) {
+        tc->bins[bin] = as_free(block)->next;
+        tc->count[bin]--;
+        return block;
+    }
+
+    if (!atomic_load_explicit(&cache_isolation, memory_order_relaxed) && (block = central_pop(bin))) {
+        tc->bins[bin] = as_free(block)->next;
+        tc->count[bin] = TCACHE_BATCH - 1;
+        return block;
+    }
+
+    unsigned batch = tc->refill[bin] ? tc->refill[bin] : 1;
+    bool fresh;
+
+    heap_lock(tc->heap);
+    if (atomic_load_explicit(&cache_isolation, memory_order_relaxed)) {
+        Block* run[TCACHE_BATCH];
+        size_t count = heap_carve_run(tc->heap, size, batch, tc->tag, run);
+        if (!count && tc->heap->segments && heap_grow(tc->heap, batch * (sizeof(Block) + size) + 2 * CACHE_LINE))
+            count = heap_carve_run(tc->heap, size, batch, tc->tag, run);
+        block = count ? run[0] : NULL;
+        for (size_t i = 1; i < count; i++) {
+            as_free(run[i])->next = tc->bins[bin];
+            tc->bins[bin] = run[i];
+            tc->count[bin]++;
+        }
+    } else {
+        block = heap_alloc(tc->heap, size, &fresh);
+        for (unsigned i = 1; block && i < batch; i++) {
+            Block* extra = heap_alloc(tc->heap, size, &fresh);
+            if (!extra)
+                break;
+            as_free(extra)->next = tc->bins[bin];
+            tc->bins[bin] = extra;
+            tc->count[bin]++;
+        }
+    }
+    heap_unlock(tc->heap);
+
+    if (batch < TCACHE_BATCH)
+        tc->refill[bin] = (uint8_t)(batch * 2);
+    return block;
+}
+
+/**
+ * Cache a small in-use block in bin, which may be below the block's own
+ * bin, flushing the oldest ones if the bin is full.
+ */
+static void tcache_free(ThreadCache* tc, Block* block, int bin) {
+    as_free(block)->next = tc->bins[bin];
+    tc->bins[bin] = block;
+    if (++tc->count[bin] > TCACHE_FILL && !central_push(tc, bin))
+        tcache_flush(tc, bin, TCACHE_FILL - TCACHE_BATCH);
+}
+
+/**
+ * Allocate from the thread's arena. When it is full, flush the thread's
+ * cache and grow the arena; only if that fails try the other arenas.
+ */
+static Block* arena_alloc(ThreadCache* tc, size_t size, bool* fresh) {
+    Heap* own = tc->heap;
+    heap_lock(own);
+    Block* block = heap_alloc(own, size, fresh);
+    heap_unlock(own);
+    if (block)
+        return block;
+
+    // Blocks parked in this thread's cache may be what is missing
+    tcache_flush_all(tc);
+    heap_lock(own);
+    block = heap_alloc(own, size, fresh);
+    if (!block && own->segments && heap_grow(own, ALIGN(size)))
+        block = heap_alloc(own, size, fresh);
+    heap_unlock(own);
+
+    for (unsigned id = 0; id < MM_MAX_ARENAS && !block; id++) {
+        Heap* h = atomic_load_explicit(&heaps[id], memory_order_acquire);
+        if (!h)
+            continue;
+        heap_lock(h);
+        block = heap_alloc(h, size, fresh);
+        heap_unlock(h);
+    }
+    return block;
+}
+
+// Requests of at least mmap_threshold bytes get a private mapping instead
+// of a block carved from an arena, so they go back to the OS on free. The
+// word just before the header of such a block holds the header's offset
+// from the start of the mapping.
+#define MM_MMAP_THRESHOLD_DEFAULT ((size_t)256 * 1024)
+#define MMAP_PREFIX sizeof(size_t)
+
+static atomic_size_t mmap_threshold = MM_MMAP_THRESHOLD_DEFAULT;
+
+static inline bool use_mmap(size_t size) {
+    return size >= atomic_load_explicit(&mmap_threshold, memory_order_relaxed);
+}
+
+static inline char* mmap_base(Block* block) {
+    return (char*)block - *((size_t*)block - 1);
+}
+
+static inline size_t mmap_length(Block* block) {
+    return (size_t)((char*)block - mmap_base(block)) + sizeof(Block) + block_size(block);
+}
+
+static void mapped_usage_add(size_t bytes) {
+    size_t now = atomic_fetch_add_explicit(&mapped_in_use, bytes, memory_order_relaxed) + bytes;
+    size_t peak = atomic_load_explicit(&mapped_peak, memory_order_relaxed);
+    while (now > peak && !atomic_compare_exchange_weak_explicit(&mapped_peak, &peak, now,
+                                                                memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+static void mapped_usage_sub(size_t bytes) {
+    atomic_fetch_sub_explicit(&mapped_in_use, bytes, memory_order_relaxed);
+}
+
+/**
+ * Map a dedicated region for one block whose payload is aligned to the
+ * given power of two. Whole pages in front of the aligned payload are
+ * unmapped again. The payload is rounded up to the end of the last page,
+ * and like all fresh mappings it reads as zero.
+ */
+static Block* mmap_alloc(size_t size, size_t alignment) {
+    size_t slack = alignment > ALIGNMENT ? alignment : 0;
+    size_t bytes = page_round(MMAP_PREFIX + sizeof(Block) + size + slack);
+    if (bytes < size)
+        return NULL; // Overflow
+
+    char* base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        MM_TRACE(MM_TRACE_ERROR, "Error: Unable to map %zu bytes.\n", bytes);
+        return NULL;
+    }
+
+    size_t offset = MMAP_PREFIX;
+    if (slack) {
+        uintptr_t payload = ((uintptr_t)base + MMAP_PREFIX + sizeof(Block) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        offset = payload - sizeof(Block) - (uintptr_t)base;
+        size_t lead = (offset - MMAP_PREFIX) & ~(page_size() - 1);
+        size_t tail = (bytes - offset - sizeof(Block) - size) & ~(page_size() - 1);
+        if (lead)
+            munmap(base, lead);
+        if (tail)
+            munmap(base + bytes - tail, tail);
+        base += lead;
+        offset -= lead;
+        bytes -= lead + tail;
+    }
+
+    *(size_t*)(base + offset - MMAP_PREFIX) = offset;
+    Block* block = (Block*)(base + offset);
+    hdr_set(block, (bytes - offset - sizeof(Block)) | FLAG_MMAPPED);
+    mapped_usage_add(sizeof(Block) + block_size(block));
+    MM_TRACE(MM_TRACE_OPS, "Mapped block at %p, Size %zu\n", (void*)block, block_size(block));
+    return block;
+}
+
+static void mmap_free(Block* block) {
+    MM_TRACE(MM_TRACE_OPS, "Unmapping block at %p, Size %zu\n", (void*)block, block_size(block));
+    mapped_usage_sub(sizeof(Block) + block_size(block));
+    munmap(mmap_base(block), mmap_length(block));
+}
+
+/**
+ * Resize a mapped block with mremap, letting the kernel move the pages
+ * instead of copying them.
+ */
+static Block* mmap_realloc(Block* block, size_t size) {
+    size_t offset = (size_t)((char*)block - mmap_base(block));
+    size_t bytes = page_round(offset + sizeof(Block) + size);
+    if (bytes < size)
+        return NULL;
+
+    size_t old_bytes = sizeof(Block) + block_size(block);
+    char* base = mremap(mmap_base(block), mmap_length(block), bytes, MREMAP_MAYMOVE);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    block = (Block*)(base + offset);
+    hdr_set(block, (bytes - offset - sizeof(Block)) | FLAG_MMAPPED);
+    mapped_usage_sub(old_bytes);
+    mapped_usage_add(sizeof(Block) + block_size(block));
+    return block;
+}
+
+#if MM_HARDENED
+// Hardened mode. Every in-use block ends with a canary derived from its
+// address, its header and a per-process secret, so a corrupt header or a
+// write past the end of the block is caught when it is freed. A freed
+// block gets a key in its second payload word, which exposes double frees
+// of blocks that still look in use (thread-cached or quarantined ones).
+// Freed blocks first wait, poisoned, in a per-thread quarantine ring, and
+// a write to them meanwhile is caught when they leave it.
+#define QUARANTINE_DEFAULT 64
+#define POISON_BYTES 64   // Poisoned and verified bytes per quarantined block
+#define POISON 0xDBDBDBDBDBDBDBDBull
+
+static uint64_t harden_secret;
+static atomic_uint quarantine_size = QUARANTINE_DEFAULT;
+
+/**
+ * Pick the secret once, before the first block is handed out.
+ */
+static void harden_seed(void) {
+    if (harden_secret)
+        return;
+    const void* random = (const void*)getauxval(AT_RANDOM);
+    uint64_t words[2] = {(uint64_t)(uintptr_t)&harden_secret, clock_ns()};
+    if (random)
+        memcpy(words, random, sizeof(words)); // 16 bytes, not necessarily aligned
+    harden_secret = words[0] ^ words[1];
+    harden_secret |= 1;
+}
+
+static inline size_t hash_word(uint64_t x) {
+    x *= 0x9E3779B97F4A7C15ull;
+    return (size_t)(x ^ (x >> 32));
+}
+
+static inline size_t* canary_slot(Block* block) {
+    return (size_t*)((char*)block_payload(block) + block_size(block) - sizeof(size_t));
+}
+
+static inline size_t canary_value(Block* block) {
+    // The flags are left out: FLAG_PREV_FREE changes with the neighbours,
+    // FLAG_SAMPLED with the profiler
+    return hash_word((uintptr_t)block ^ (hdr_get(block) & ~(FLAG_MASK | FLAG_SAMPLED)) ^ harden_secret);
+}
+
+static inline size_t* key_slot(Block* block) {
+    return (size_t*)block_payload(block) + 1;
+}
+
+static inline size_t free_key(Block* block) {
+    return hash_word((uintptr_t)block ^ ~harden_secret);
+}
+
+static void harden_fail(const char* what, void* ptr) {
+    char msg[128];
+    int n = snprintf(msg, sizeof(msg), "mem_manage: %s: %p\n", what, ptr);
+    if (write(STDERR_FILENO, msg, (size_t)n) < 0)
+        abort();
+    abort();
+}
+
+/**
+ * Verify a block that is being freed or resized: its canary must be
+ * intact and it must not carry the key of a block already freed.
+ */
+static void harden_check(Heap* owner, Block* block, void* ptr) {
+    if (*key_slot(block) == free_key(block))
+        harden_fail("double free", ptr);
+    if (owner && (char*)block_payload(block) + block_size(block) > atomic_load_explicit(&owner->hi, memory_order_relaxed))
+        harden_fail("corrupt block header", ptr);
+    if (*canary_slot(block) != canary_value(block))
+        harden_fail("heap buffer overflow or corrupt block header", ptr);
+}
+
+// Number of words poisoned behind the key of a quarantined block
+static inline size_t poison_words(Block* block) {
+    size_t usable = block_size(block) - CANARY_SIZE;
+    return (usable < POISON_BYTES ? usable : POISON_BYTES) / sizeof(size_t) - 2;
+}
+
+/**
+ * Put a freed block into the calling thread's quarantine, poisoned, and
+ * return the block it displaces (or the block itself when the quarantine
+ * is off), checked for writes after free.
+ */
+static Block* quarantine_put(ThreadCache* tc, Block* block) {
+    *key_slot(block) = free_key(block);
+    unsigned limit = atomic_load_explicit(&quarantine_size, memory_order_relaxed);
+    if (!limit)
+        return block;
+
+    size_t* words = key_slot(block) + 1;
+    for (size_t i = 0, n = poison_words(block); i < n; i++)
+        words[i] = POISON;
+
+    unsigned slot = tc->quarantine_next % limit;
+    Block* old = tc->quarantine[slot];
+    tc->quarantine[slot] = block;
+    tc->quarantine_next = (slot + 1) % limit;
+    if (!old)
+        return NULL;
+
+    words = key_slot(old) + 1;
+    for (size_t i = 0, n = poison_words(old); i < n; i++) {
+        if (words[i] != POISON)
+            harden_fail("write after free", block_payload(old));
+    }
+    return old;
+}
+#endif
+
+/**
+ * Prepare a block for the caller: in hardened builds, arm its canary and
+ * clear any free key left in the payload.
+ */
+static inline void* hand_out(Block* block) {
+#if MM_HARDENED
+    *canary_slot(block) = canary_value(block);
+    *key_slot(block) = 0;
+#endif
+    return block_payload(block);
+}
+
+/**
+ * Finish resizing a block in place: hardened builds move its canary to
+ * the new end.
+ */
+static inline void* resized(Block* block) {
+#if MM_HARDENED
+    *canary_slot(block) = canary_value(block);
+#endif
+    return block_payload(block);
+}
+
+/**
+ * Report a pointer that cannot be freed; hardened builds abort.
+ */
+static void bad_free(const char* what, void* ptr) {
+#if MM_HARDENED
+    harden_fail(what, ptr);
+#else
+    MM_TRACE(MM_TRACE_ERROR, "%s in mm_free: %p\n", what, ptr);
+    (void)what;
+    (void)ptr;
+#endif
+}
+
+/**
+ * The heap that a heap block being freed or resized belongs to. Returns
+ * NULL, after reporting it, if ptr is not a block in use of any heap.
+ */
+static Heap* block_owner(Block* block, void* ptr) {
+    unsigned id = block_heap_id(block);
+    Heap* owner = id < MM_MAX_HEAPS ? atomic_load_explicit(&heaps[id], memory_order_acquire) : NULL;
+    if (!owner || !heap_contains(owner, ptr)) {
+        bad_free("Invalid pointer passed", ptr);
+        return NULL;
+    }
+    if (block_is_free(block)) {
+        bad_free("Double free detected", ptr);
+        return NULL;
+    }
+    return owner;
+}
+
+/**
+ * Whether a small block may go into this thread's cache: with cache
+ * isolation, only if it was carved for the thread.
+ */
+static inline bool tcache_owns(ThreadCache* tc, Block* block) {
+    return !atomic_load_explicit(&cache_isolation, memory_order_relaxed) ||
+           (hdr_get(block) & ~(((size_t)1 << THREAD_TAG_SHIFT) - 1)) == tc->tag;
+}
+
+/**
+ * Return an in-use block to a thread cache, its owner's remote stack or
+ * its owner's free lists.
+ */
+static void free_block(ThreadCache* tc, Heap* owner, Block* block) {
+    // Blocks of mm_heap_create heaps are never cached: the heap may be
+    // destroyed while they wait
+    if (block_size(block) <= TCACHE_MAX_SIZE && owner->id < MM_MAX_ARENAS && tcache_owns(tc, block)) {
+        tcache_free(tc, block, size_to_bin(block_size(block)));
+        return;
+    }
+
+    if (owner != tc->heap && owner->id < MM_MAX_ARENAS) {
+        remote_free_push(owner, block, block);
+        return;
+    }
+
+    heap_lock(owner);
+    heap_free(owner, block);
+    heap_unlock(owner);
+}
+
+static void quarantine_drain(ThreadCache* tc) {
+#if MM_HARDENED
+    if (tc->epoch != atomic_load_explicit(&heap_epoch, memory_order_acquire))
+        return; // Blocks of a heap that no longer exists
+    for (unsigned i = 0; i < QUARANTINE_MAX; i++) {
+        Block* block = tc->quarantine[i];
+        if (block) {
+            tc->quarantine[i] = NULL;
+            free_block(tc, atomic_load_explicit(&heaps[block_heap_id(block)], memory_order_acquire), block);
+        }
+    }
+#else
+    (void)tc;
+#endif
+}
+
+/**
+ * Initialize the memory manager with a fixed block of memory.
+ */
+void mm_init(size_t memory_size) {
+    if (memory_size < MIN_BLOCK_SIZE + ALIGNMENT) {
+        MM_TRACE(MM_TRACE_ERROR, "Error: Memory size too small for initialization.\n");
+        return;
+    }
+
+    memory_size = ALIGN(memory_size);
 
-// Align size to 8 bytes
-#define ALIGN(size) (((size) + 7) & ~7)
+    pthread_mutex_lock(&arenas_lock);
+    pthread_mutex_lock(&main_heap.lock);
 
-// Minimum block size to store metadata
-#define MIN_BLOCK_SIZE (sizeof(Block))
+#if MM_HARDENED
+    harden_seed();
+#endif
 
-/**
- * Helper function to swap two blocks in the heap.
- */
-static void swap(size_t i, size_t j) {
-    Block* temp = heap[i];
-    heap[i] = heap[j];
-    heap[j] = temp;
+    // Give the previous heap back first, so its break can be reused
+    arenas_release();
+    atomic_store_explicit(&heaps[0], NULL, memory_order_release);
+    heap_reset(&main_heap);
+    central_reset();
+    sample_drop(0, MM_MAX_ARENAS);
+    atomic_fetch_add_explicit(&heap_epoch, 1, memory_order_release);
+    atomic_store_explicit(&mapped_peak, atomic_load_explicit(&mapped_in_use, memory_order_relaxed),
+                          memory_order_relaxed);
+
+    // The region also holds the segment header and the epilogue that
+    // terminates the heap, plus whatever aligns the current break. With
+    // huge pages it is mapped instead, rounded up to whole huge pages.
+    size_t huge = atomic_load_explicit(&huge_page_size, memory_order_relaxed);
+    size_t region = memory_size + SEGMENT_OVERHEAD;
+    void* start;
+    if (huge) {
+        region = round_up(region, huge);
+        start = huge_map(region, huge);
+    } else {
+        uintptr_t brk = (uintptr_t)sbrk(0);
+        region += ALIGN(brk) - brk;
+        start = sbrk(region);
+    }
+    if (start == (void*)-1) {
+        pthread_mutex_unlock(&main_heap.lock);
+        pthread_mutex_unlock(&arenas_lock);
+        MM_TRACE(MM_TRACE_ERROR, "Error: Unable to allocate memory for the heap.\n");
+        return;
+    }
+
+    // Every further arena gets a region of the same size, created on demand
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    arena_count = cpus > 0 ? (unsigned)cpus * 4 : 1;
+    if (arena_count > MM_MAX_ARENAS)
+        arena_count = MM_MAX_ARENAS;
+    numa_nodes = numa_node_count();
+    if (numa_nodes > arena_count || numa_nodes > sizeof(unsigned long) * 8)
+        numa_nodes = 1; // More nodes than arenas: plain round-robin
+    arena_size = memory_size;
+    atomic_store_explicit(&next_arena, 0, memory_order_relaxed);
+
+    main_heap.id = 0;
+    main_heap.use_sbrk = !huge;
+    main_heap.page = huge ? huge : page_size();
+    segment_add(&main_heap, start, region, huge);
+    atomic_store_explicit(&heaps[0], &main_heap, memory_order_release);
+
+    pthread_mutex_unlock(&main_heap.lock);
+    pthread_mutex_unlock(&arenas_lock);
 }
 
 /**
- * Min-Heap: Percolate up to maintain heap property.
+ * Allocate a block of memory. The *_untraced functions implement the
+ * public entry points, which add trace records on top.
  */
-static void heapify_up(size_t index) {
-    while (index > 0) {
-        size_t parent = (index - 1) / 2;
-        if (heap[index]->size < heap[parent]->size) {
-            swap(index, parent);
-            index = parent;
-        } else {
-            break;
-        }
+static void* malloc_untraced(size_t size) {
+    if (size == 0) {
+        MM_TRACE(MM_TRACE_OPS, "Requested allocation size is 0. Returning NULL.\n");
+        return NULL;
+    }
+    if (size > MM_MAX_REQUEST) {
+        MM_TRACE(MM_TRACE_ERROR, "Requested allocation size %zu is too large.\n", size);
+        return NULL;
+    }
+
+    ThreadCache* tc = tcache_get();
+    stat_request(size);
+    size = REQUEST_SIZE(size);
+    if (size <= TCACHE_MAX_SIZE) {
+        Block* block = tcache_alloc(tc, size);
+        if (block)
+            return hand_out(block);
+    } else if (use_mmap(size)) {
+        Block* block = mmap_alloc(size, ALIGNMENT);
+        return block ? hand_out(block) : NULL;
     }
+
+    bool fresh;
+    Block* block = arena_alloc(tc, size, &fresh);
+    return block ? hand_out(block) : NULL;
 }
 
 /**
- * Min-Heap: Percolate down to maintain heap property.
+ * Allocate zero-initialized memory for an array of count elements.
  */
-static void heapify_down(size_t index) {
-    size_t smallest = index;
-    size_t left = 2 * index + 1;
-    size_t right = 2 * index + 2;
+static void* calloc_untraced(size_t count, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        MM_TRACE(MM_TRACE_ERROR, "mm_calloc size overflow: %zu * %zu\n", count, size);
+        return NULL;
+    }
+    if (total == 0) {
+        MM_TRACE(MM_TRACE_OPS, "Requested allocation size is 0. Returning NULL.\n");
+        return NULL;
+    }
+    if (total > MM_MAX_REQUEST) {
+        MM_TRACE(MM_TRACE_ERROR, "Requested allocation size %zu is too large.\n", total);
+        return NULL;
+    }
 
-    if (left < heap_count && heap[left]->size < heap[smallest]->size)
-        smallest = left;
+    // Cached small blocks have been used before, so always clear them
+    if (REQUEST_SIZE(total) <= TCACHE_MAX_SIZE) {
+        void* ptr = malloc_untraced(total);
+        if (ptr)
+            memset(ptr, 0, total);
+        return ptr;
+    }
 
-    if (right < heap_count && heap[right]->size < heap[smallest]->size)
-        smallest = right;
+    stat_request(total);
+    size_t request = REQUEST_SIZE(total);
+    bool fresh = true;
+    Block* block = use_mmap(request) ? mmap_alloc(request, ALIGNMENT) : arena_alloc(tcache_get(), request, &fresh);
+    if (!block)
+        return NULL;
 
-    if (smallest != index) {
-        swap(index, smallest);
-        heapify_down(smallest);
+    void* payload = block_payload(block);
+    if (fresh) {
+        // Untouched memory: only the free-list links and, for an unsplit
+        // block, the footer were written
+        size_t size_bytes = block_size(block);
+        memset(payload, 0, sizeof(FreeBlock) - sizeof(Block));
+        *(Footer*)((char*)payload + size_bytes - sizeof(Footer)) = 0;
+    } else {
+        memset(payload, 0, total);
     }
+    return hand_out(block);
 }
 
 /**
- * Insert a block into the min-heap.
+ * Allocate size bytes whose address is a multiple of alignment, which
+ * must be a power of two.
  */
-static void heap_insert(Block* block) {
-    if (heap_count >= MAX_HEAP_SIZE) {
-        printf("Error: Free block heap overflow. Cannot insert block.\n");
-        return;
+static void* aligned_alloc_untraced(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        MM_TRACE(MM_TRACE_ERROR, "Alignment %zu is not a power of two.\n", alignment);
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT)
+        return malloc_untraced(size); // Every payload is aligned this much
+    if (size == 0) {
+        MM_TRACE(MM_TRACE_OPS, "Requested allocation size is 0. Returning NULL.\n");
+        return NULL;
+    }
+    if (size > MM_MAX_REQUEST || alignment > MM_MAX_REQUEST) {
+        MM_TRACE(MM_TRACE_ERROR, "Requested allocation size %zu aligned to %zu is too large.\n", size, alignment);
+        return NULL;
+    }
+
+    stat_request(size);
+
+    // Over-allocate so the aligned payload leaves room for a free block in front
+    size = REQUEST_SIZE(size);
+    size_t padded = size + alignment + MIN_BLOCK_SIZE;
+    if (use_mmap(padded)) {
+        Block* block = mmap_alloc(size, alignment);
+        return block ? hand_out(block) : NULL;
     }
 
-    heap[heap_count] = block;
-    printf("Inserting block into heap: Address %p, Size %zu\n", (void*)block, block->size);
-    heapify_up(heap_count);
-    heap_count++;
+    bool fresh;
+    Block* block = arena_alloc(tcache_get(), padded, &fresh);
+    if (!block)
+        return NULL;
+
+    Heap* owner = atomic_load_explicit(&heaps[block_heap_id(block)], memory_order_acquire);
+    heap_lock(owner);
+    block = heap_align(owner, block, alignment, size);
+    heap_unlock(owner);
+    return hand_out(block);
 }
 
+/**
+ * Allocate size bytes aligned to alignment (a power of two).
+ */
+void* mm_memalign(size_t alignment, size_t size) {
+    return mm_aligned_alloc(alignment, size);
+}
 
 /**
- * Extract the smallest block from the min-heap.
+ * posix_memalign-style aligned allocation: store the block in *memptr and
+ * return 0, EINVAL for a bad alignment, or ENOMEM.
  */
-static Block* heap_extract_min() {
-    if (heap_count == 0) {
-        printf("Heap is empty. No blocks available for allocation.\n");
-        return NULL;
+int mm_posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (alignment == 0 || alignment % sizeof(void*) || (alignment & (alignment - 1)))
+        return EINVAL;
+    if (size == 0) {
+        *memptr = NULL;
+        return 0;
     }
 
-    Block* min_block = heap[0];
-    printf("Extracting smallest block from heap: Address %p, Size %zu\n", (void*)min_block, min_block->size);
-    heap[0] = heap[--heap_count];
-    heapify_down(0);
-    return min_block;
+    void* ptr = mm_aligned_alloc(alignment, size);
+    if (!ptr)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
 }
 
+/**
+ * Free a previously allocated block of memory.
+ */
+static void free_untraced(void* ptr) {
+    if (!ptr) {
+        MM_TRACE(MM_TRACE_ERROR, "Invalid pointer passed to mm_free: %p\n", ptr);
+        return;
+    }
+
+    Block* block = (Block*)((char*)ptr - sizeof(Block));
+    if (hdr_get(block) & FLAG_MMAPPED) {
+#if MM_HARDENED
+        harden_check(NULL, block, ptr);
+#endif
+        if (hdr_get(block) & FLAG_SAMPLED)
+            sample_remove(ptr);
+        stat_event(STAT_FREE);
+        mmap_free(block);
+        return;
+    }
+
+    Heap* owner = block_owner(block, ptr);
+    if (!owner)
+        return;
+    if (hdr_get(block) & FLAG_SAMPLED)
+        sample_forget(block);
+
+    ThreadCache* tc = tcache_get();
+    stat_event(STAT_FREE);
+#if MM_HARDENED
+    harden_check(owner, block, ptr);
+    if (owner->id < MM_MAX_ARENAS) {
+        block = quarantine_put(tc, block);
+        if (!block)
+            return;
+        owner = atomic_load_explicit(&heaps[block_heap_id(block)], memory_order_acquire);
+    }
+#endif
+    free_block(tc, owner, block);
+}
 
 /**
- * Initialize the memory manager with a fixed block of memory.
+ * Free a block whose requested size the caller still knows. The size
+ * picks the thread-cache bin, so a small block is cached without the
+ * ownership checks; it must lie between the requested and usable size.
  */
-void mm_init(size_t memory_size) {
-    if (memory_size < MIN_BLOCK_SIZE) {
-        fprintf(stderr, "Error: Memory size too small for initialization.\n");
+static void free_sized_untraced(void* ptr, size_t size) {
+#if MM_HARDENED
+    // Keep every check, and verify the size on top
+    if (ptr && size > mm_usable_size(ptr))
+        harden_fail("mm_free_sized called with a wrong size", ptr);
+    free_untraced(ptr);
+#else
+    if (!ptr)
+        return;
+
+    Block* block = (Block*)((char*)ptr - sizeof(Block));
+    size = REQUEST_SIZE(size);
+    size_t hdr = hdr_get(block);
+    if (size > TCACHE_MAX_SIZE || (hdr & (FLAG_MMAPPED | FLAG_SAMPLED)) || block_heap_id(block) >= MM_MAX_ARENAS) {
+        free_untraced(ptr);
         return;
     }
 
-    heap_start = sbrk(memory_size);
-    if (heap_start == (void*)-1) {
-        fprintf(stderr, "Error: Unable to allocate memory using sbrk.\n");
+    ThreadCache* tc = tcache_get();
+    if (!tcache_owns(tc, block)) {
+        free_untraced(ptr);
         return;
     }
+    stat_event(STAT_FREE);
+    tcache_free(tc, block, size_to_bin(size));
+#endif
+}
+
+/**
+ * Allocate n blocks of size bytes into ptrs. Small ones come from the
+ * thread cache first; the rest are carved in runs from free blocks of the
+ * thread's arena under one lock. Whatever that leaves over goes through
+ * malloc_untraced, which can grow the heap. Returns how many blocks were
+ * allocated.
+ */
+static size_t malloc_batch_untraced(size_t size, size_t n, void** ptrs) {
+    if (size == 0 || size > MM_MAX_REQUEST || n == 0)
+        return 0;
+
+    ThreadCache* tc = tcache_get();
+    size_t request = REQUEST_SIZE(size);
+    size_t count = 0;
+    if (!use_mmap(request)) {
+        Block** blocks = (Block**)ptrs; // Headers first, payloads below
+        if (request <= TCACHE_MAX_SIZE) {
+            int bin = size_to_bin(request);
+            for (; count < n && tc->bins[bin]; count++) {
+                blocks[count] = tc->bins[bin];
+                tc->bins[bin] = as_free(blocks[count])->next;
+                tc->count[bin]--;
+            }
+        }
+
+        heap_lock(tc->heap);
+        for (size_t carved = 1; count < n && carved; count += carved)
+            carved = heap_carve(tc->heap, request, n - count, blocks + count);
+        heap_unlock(tc->heap);
+
+        for (size_t i = 0; i < count; i++)
+            ptrs[i] = hand_out(blocks[i]);
+        stat_add(&thread_stats.events[STAT_MALLOC], count);
+        stat_add(&thread_stats.sizes[size_to_stat_class(size)], count);
+    }
 
-    heap_size = memory_size;
-    Block* initial_block = (Block*)heap_start;
-    initial_block->size = memory_size - sizeof(Block);
-    initial_block->is_free = true;
-    initial_block->next = NULL;
+    for (; count < n && (ptrs[count] = malloc_untraced(size)); count++)
+        ;
+    return count;
+}
 
-    heap_insert(initial_block); // Add the initial block to the heap
+#if !MM_HARDENED
+static int compare_address(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)*(void* const*)a, y = (uintptr_t)*(void* const*)b;
+    return (x > y) - (x < y);
 }
+#endif
 
 /**
- * Allocate a block of memory.
+ * Free n blocks at once. Sorting them by address lines up physical
+ * neighbours, and each run of them is merged into one block before it is
+ * returned, so the free lists see a single insertion per run. A heap is
+ * locked once for all its blocks that come in a row.
  */
-void* mm_malloc(size_t size) {
+static void free_batch_untraced(void** ptrs, size_t n) {
+#if MM_HARDENED
+    // Every block has to go through the checks and the quarantine
+    for (size_t i = 0; i < n; i++)
+        free_untraced(ptrs[i]);
+#else
+    qsort(ptrs, n, sizeof(*ptrs), compare_address);
+    Heap* locked = NULL;
+    for (size_t i = 0; i < n;) {
+        void* ptr = ptrs[i++];
+        if (!ptr)
+            continue;
+        if (i > 1 && ptrs[i - 2] == ptr) {
+            bad_free("Double free detected", ptr);
+            continue;
+        }
+
+        Block* block = (Block*)((char*)ptr - sizeof(Block));
+        if (hdr_get(block) & FLAG_SAMPLED)
+            sample_remove(ptr); // The header is rewritten when the block is freed
+        if (hdr_get(block) & FLAG_MMAPPED) {
+            stat_event(STAT_FREE);
+            mmap_free(block);
+            continue;
+        }
+
+        Heap* owner = block_owner(block, ptr);
+        if (!owner)
+            continue;
+
+        // Extend the run while the next pointer is the next block
+        Block* last = block;
+        size_t count = 1;
+        while (i < n && ptrs[i] == block_payload(next_block(last)) && !block_is_free(next_block(last))) {
+            last = next_block(last);
+            if (hdr_get(last) & FLAG_SAMPLED)
+                sample_remove(block_payload(last));
+            i++;
+            count++;
+        }
+        stat_add(&thread_stats.events[STAT_FREE], count);
+
+        if (owner != locked) {
+            if (locked)
+                heap_unlock(locked);
+            heap_lock(owner);
+            locked = owner;
+        }
+        if (count > 1) {
+            size_t bytes = (size_t)((char*)block_payload(last) + block_size(last) - (char*)ptr);
+            hdr_set(block, bytes | (hdr_get(block) & ~SIZE_MASK));
+            stat_add(&thread_stats.events[STAT_COALESCE], count - 1);
+        }
+        heap_free(owner, block);
+    }
+    if (locked)
+        heap_unlock(locked);
+#endif
+}
+
+
+/**
+ * Allocate size bytes from a heap made by mm_heap_create, growing it as
+ * needed. Such heaps never use the thread caches or mmap'd blocks, so all
+ * their memory goes away with mm_heap_destroy.
+ */
+static void* heap_malloc_untraced(Heap* h, size_t size) {
+    if (size == 0 || size > MM_MAX_REQUEST)
+        return NULL;
+
+    stat_request(size);
+    size = REQUEST_SIZE(size);
+    bool fresh;
+    heap_lock(h);
+    Block* block = heap_alloc(h, size, &fresh);
+    if (!block && heap_grow(h, size))
+        block = heap_alloc(h, size, &fresh);
+    heap_unlock(h);
+    return block ? hand_out(block) : NULL;
+}
+
+/**
+ * Reallocate a previously allocated block of memory.
+ */
+static void* realloc_untraced(void* ptr, size_t size) {
+    if (!ptr) return malloc_untraced(size);
     if (size == 0) {
-        printf("Requested allocation size is 0. Returning NULL.\n");
+        free_untraced(ptr);
         return NULL;
     }
 
-    size = ALIGN(size);
-    printf("Requested allocation of size %zu (aligned to %zu).\n", size, size);
+    if (size > MM_MAX_REQUEST) {
+        MM_TRACE(MM_TRACE_ERROR, "Requested allocation size %zu is too large.\n", size);
+        return NULL;
+    }
 
-    Block* block = heap_extract_min(); // Get the smallest suitable block
-    if (!block || block->size < size) {
-        printf("Allocation failed. Not enough memory available.\n");
+    stat_event(STAT_REALLOC);
+    Block* block = (Block*)((char*)ptr - sizeof(Block));
+    Heap* owner = NULL;
+    if (!(hdr_get(block) & FLAG_MMAPPED) && !(owner = block_owner(block, ptr)))
         return NULL;
+    if (hdr_get(block) & FLAG_SAMPLED)
+        sample_forget(block); // mm_realloc counts the result as a new allocation
+    size_t old_size = block_size(block) - CANARY_SIZE;
+    size_t new_size = REQUEST_SIZE(size);
+    Heap* home = NULL;
+
+    if (hdr_get(block) & FLAG_MMAPPED) {
+#if MM_HARDENED
+        harden_check(NULL, block, ptr);
+#endif
+        // Stay mapped while large enough; mremap moves pages, not bytes
+        if (use_mmap(new_size)) {
+            if (new_size <= block_size(block) && block_size(block) - new_size < page_size())
+                return ptr;
+            Block* moved = mmap_realloc(block, new_size);
+            return moved ? resized(moved) : NULL;
+        }
+    } else {
+#if MM_HARDENED
+        harden_check(owner, block, ptr);
+#endif
+        bool done = new_size <= block_size(block);
+
+        // Shrink by splitting off the tail, grow into a free successor
+        heap_lock(owner);
+        if (done)
+            heap_shrink(owner, block, new_size);
+        else
+            done = heap_expand(owner, block, new_size);
+        heap_unlock(owner);
+
+        if (done)
+            return resized(block);
+        if (owner->id >= MM_MAX_ARENAS)
+            home = owner; // Stay in the caller's heap
     }
 
-    // Split the block if it's large enough
-    if (block->size >= size + sizeof(Block) + ALIGN(1)) {
-        Block* new_block = (Block*)((char*)block + sizeof(Block) + size);
-        new_block->size = block->size - size - sizeof(Block);
-        new_block->is_free = true;
+    void* new_ptr = home ? heap_malloc_untraced(home, size) : malloc_untraced(size);
+    if (new_ptr) {
+        memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        free_untraced(ptr);
+    }
+
+    return new_ptr;
+}
+
+void* mm_malloc(size_t size) {
+    void* ptr = malloc_untraced(size);
+    if (tracing())
+        trace_record(MM_OP_MALLOC, ptr, NULL, size);
+    if (sample_due(size))
+        sample_take(ptr, size);
+    return ptr;
+}
+
+void* mm_calloc(size_t count, size_t size) {
+    void* ptr = calloc_untraced(count, size);
+    if (tracing())
+        trace_record(MM_OP_CALLOC, ptr, NULL, count * size);
+    if (sample_due(count * size))
+        sample_take(ptr, count * size);
+    return ptr;
+}
+
+void* mm_aligned_alloc(size_t alignment, size_t size) {
+    void* ptr = aligned_alloc_untraced(alignment, size);
+    if (tracing())
+        trace_record(MM_OP_ALIGNED, ptr, (void*)alignment, size);
+    if (sample_due(size))
+        sample_take(ptr, size);
+    return ptr;
+}
+
+void mm_free(void* ptr) {
+    if (tracing())
+        trace_record(MM_OP_FREE, NULL, ptr, 0);
+    free_untraced(ptr);
+}
 
-        printf("Splitting block: Allocated size %zu, Remaining size %zu\n", size, new_block->size);
-        heap_insert(new_block); // Return the remaining part to the heap
-        block->size = size;
+size_t mm_malloc_batch(size_t size, size_t n, void** ptrs) {
+    size_t count = malloc_batch_untraced(size, n, ptrs);
+    if (tracing()) {
+        for (size_t i = 0; i < count; i++)
+            trace_record(MM_OP_MALLOC, ptrs[i], NULL, size);
     }
+    if (count && sample_due(count * size))
+        sample_take(ptrs[count - 1], size);
+    return count;
+}
 
-    block->is_free = false;
-    memset((char*)block + sizeof(Block), 0, size);
-    printf("Allocation successful: Block at %p, Size %zu\n", (void*)block, block->size);
-    return (char*)block + sizeof(Block);
+void mm_free_batch(void** ptrs, size_t n) {
+    if (tracing()) {
+        for (size_t i = 0; i < n; i++)
+            trace_record(MM_OP_FREE, NULL, ptrs[i], 0);
+    }
+    free_batch_untraced(ptrs, n);
+}
+
+void mm_free_sized(void* ptr, size_t size) {
+    if (tracing())
+        trace_record(MM_OP_FREE, NULL, ptr, 0);
+    free_sized_untraced(ptr, size);
 }
 
+void* mm_realloc(void* ptr, size_t size) {
+    void* new_ptr = realloc_untraced(ptr, size);
+    if (tracing())
+        trace_record(MM_OP_REALLOC, new_ptr, ptr, size);
+    if (sample_due(size))
+        sample_take(new_ptr, size);
+    return new_ptr;
+}
 
 /**
- * Free a previously allocated block of memory.
+ * Create a heap of its own with an initial size bytes (0 for the
+ * default). Returns NULL when the memory or heap ids run out.
  */
-void mm_free(void* ptr) {
-    if (!ptr || ptr < heap_start || ptr >= (void*)((char*)heap_start + heap_size)) {
-        printf("Invalid pointer passed to mm_free: %p\n", ptr);
+mm_heap_t* mm_heap_create(size_t size) {
+#if MM_HARDENED
+    harden_seed();
+#endif
+    if (size > MM_MAX_REQUEST)
+        return NULL;
+
+    Heap* h = NULL;
+    pthread_mutex_lock(&arenas_lock);
+    for (unsigned id = MM_MAX_ARENAS; id < MM_MAX_HEAPS; id++) {
+        if (!atomic_load_explicit(&heaps[id], memory_order_relaxed)) {
+            if ((h = heap_create(id, size ? ALIGN(size) : MM_DEFAULT_HEAP_SIZE)))
+                atomic_store_explicit(&heaps[id], h, memory_order_release);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&arenas_lock);
+    return h;
+}
+
+void* mm_heap_malloc(mm_heap_t* heap, size_t size) {
+    void* ptr = heap_malloc_untraced(heap, size);
+    if (tracing())
+        trace_record(MM_OP_MALLOC, ptr, NULL, size);
+    if (sample_due(size))
+        sample_take(ptr, size);
+    return ptr;
+}
+
+/**
+ * Release a heap and every block in it at once, however many there are.
+ */
+void mm_heap_destroy(mm_heap_t* heap) {
+    if (!heap)
         return;
+
+    pthread_mutex_lock(&walk_lock);
+    pthread_mutex_lock(&arenas_lock);
+    atomic_store_explicit(&heaps[heap->id], NULL, memory_order_release);
+    pthread_mutex_unlock(&arenas_lock);
+    pthread_mutex_unlock(&walk_lock);
+
+    sample_drop(heap->id, heap->id + 1);
+    heap_reset(heap);
+    pthread_mutex_destroy(&heap->lock);
+    munmap(heap, HEAP_MAPPING_SIZE);
+}
+
+/**
+ * Start recording every allocation call to a new trace file at path.
+ */
+int mm_trace_start(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        MM_TRACE(MM_TRACE_ERROR, "Error: Unable to open trace file %s.\n", path);
+        return -1;
     }
 
-    Block* block = (Block*)((char*)ptr - sizeof(Block));
-    block->is_free = true;
-
-    printf("Freeing block at address %p, Size %zu\n", (void*)block, block->size);
-
-    // Insert the freed block back into the heap
-    heap_insert(block);
-
-    // Coalesce adjacent free blocks
-    for (size_t i = 0; i < heap_count; i++) {
-        Block* current = heap[i];
-        if (current->is_free) {
-            Block* next = (Block*)((char*)current + sizeof(Block) + current->size);
-            if ((void*)next < (void*)((char*)heap_start + heap_size) && next->is_free) {
-                printf("Coalescing blocks: Current block %p (Size %zu) with Next block %p (Size %zu)\n",
-                       (void*)current, current->size, (void*)next, next->size);
-
-                current->size += sizeof(Block) + next->size;
-                heap[i] = heap[--heap_count]; // Remove the merged block
-                heapify_down(i);
-                i = -1; // Restart coalescing
+    struct mm_trace_header header = { MM_TRACE_MAGIC, MM_TRACE_VERSION, sizeof(struct mm_trace_record) };
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+        close(fd);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&trace_lock);
+    if (trace_fd >= 0)
+        close(trace_fd);
+    trace_fd = fd;
+    atomic_store_explicit(&trace_start_ns, clock_ns(), memory_order_relaxed);
+    atomic_fetch_add_explicit(&trace_generation, 1, memory_order_relaxed);
+    atomic_store_explicit(&trace_on, true, memory_order_release);
+    pthread_rwlock_unlock(&trace_lock);
+    return 0;
+}
+
+/**
+ * Write out the calling thread's pending trace records.
+ */
+void mm_trace_flush(void) {
+    if (trace_buffer && trace_buffer->used)
+        trace_flush(trace_buffer);
+}
+
+/**
+ * Stop recording and close the trace file. Records still buffered by
+ * other running threads are dropped.
+ */
+void mm_trace_stop(void) {
+    atomic_store_explicit(&trace_on, false, memory_order_relaxed);
+    mm_trace_flush();
+
+    pthread_rwlock_wrlock(&trace_lock);
+    if (trace_fd >= 0)
+        close(trace_fd);
+    trace_fd = -1;
+    atomic_fetch_add_explicit(&trace_generation, 1, memory_order_relaxed);
+    pthread_rwlock_unlock(&trace_lock);
+}
+
+/**
+ * Return free memory to the OS: the free ends of all segments beyond pad
+ * bytes, and the interior pages of large free blocks. The calling thread's
+ * cached blocks are flushed first. Returns 1 if any memory was released.
+ */
+int mm_trim(size_t pad) {
+    tcache_flush_all(&tcache);
+    for (int bin = 0; bin < TCACHE_BINS; bin++) {
+        for (Block* batch; (batch = central_pop(bin));)
+            free_chain(&main_heap, batch);
+    }
+
+    size_t released = 0;
+    pthread_mutex_lock(&arenas_lock);
+    for (unsigned id = 0; id < MM_MAX_HEAPS; id++) {
+        Heap* h = atomic_load_explicit(&heaps[id], memory_order_acquire);
+        if (!h)
+            continue;
+        heap_lock(h);
+        released += heap_trim(h, pad);
+        heap_unlock(h);
+    }
+    pthread_mutex_unlock(&arenas_lock);
+    return released > 0;
+}
+
+static void* decommit_main(void* arg) {
+    pthread_mutex_lock(&decommit_lock);
+    while (decommit_interval_ms) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t)(decommit_interval_ms / 1000);
+        deadline.tv_nsec += (long)(decommit_interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        int rc = 0;
+        while (decommit_interval_ms && rc != ETIMEDOUT)
+            rc = pthread_cond_timedwait(&decommit_cond, &decommit_lock, &deadline);
+        if (!decommit_interval_ms)
+            break;
+
+        pthread_mutex_unlock(&decommit_lock);
+        mm_trim(0);
+        pthread_mutex_lock(&decommit_lock);
+    }
+    pthread_mutex_unlock(&decommit_lock);
+    return arg;
+}
+
+/**
+ * Start, retime or (with 0) stop the background decommit thread.
+ */
+static int decommit_set_interval(size_t ms) {
+    pthread_mutex_lock(&decommit_lock);
+    decommit_interval_ms = ms;
+    if (ms && !decommit_running) {
+        decommit_running = pthread_create(&decommit_thread, NULL, decommit_main, NULL) == 0;
+        if (!decommit_running)
+            decommit_interval_ms = 0;
+        pthread_mutex_unlock(&decommit_lock);
+        return decommit_running ? 0 : -1;
+    }
+
+    pthread_cond_signal(&decommit_cond);
+    bool stop = !ms && decommit_running;
+    decommit_running = decommit_running && !stop;
+    pthread_mutex_unlock(&decommit_lock);
+    if (stop)
+        pthread_join(decommit_thread, NULL);
+    return 0;
+}
+
+/**
+ * Set an allocator parameter.
+ */
+int mm_mallopt(int option, size_t value) {
+    switch (option) {
+        case MM_OPT_MMAP_THRESHOLD:
+            if (value == 0)
+                return -1;
+            atomic_store_explicit(&mmap_threshold, value, memory_order_relaxed);
+            return 0;
+        case MM_OPT_DECOMMIT_THRESHOLD:
+            atomic_store_explicit(&decommit_threshold, value, memory_order_relaxed);
+            return 0;
+        case MM_OPT_DECOMMIT_INTERVAL:
+            return decommit_set_interval(value);
+        case MM_OPT_QUARANTINE:
+#if MM_HARDENED
+            if (value > QUARANTINE_MAX)
+                return -1;
+            atomic_store_explicit(&quarantine_size, (unsigned)value, memory_order_relaxed);
+            return 0;
+#else
+            return -1; // Only hardened builds have a quarantine
+#endif
+        case MM_OPT_SAMPLE_RATE:
+            if (value) {
+                // The first backtrace loads the unwinder, which allocates;
+                // do that now rather than while sampling
+                void* frame;
+                backtrace(&frame, 1);
+                pthread_mutex_lock(&sample_lock);
+                sample_period = value;
+                pthread_mutex_unlock(&sample_lock);
+            }
+            atomic_store_explicit(&sample_rate, value, memory_order_relaxed);
+            sample_left = 0; // Draw a new interval on the next allocation
+            return 0;
+        case MM_OPT_CACHE_ISOLATION:
+            atomic_store_explicit(&cache_isolation, value != 0, memory_order_relaxed);
+            return 0;
+        case MM_OPT_HUGE_PAGES:
+            if (value && ((value & (value - 1)) || value <= page_size()))
+                return -1;
+            atomic_store_explicit(&huge_page_size, value, memory_order_relaxed);
+            return 0;
+        default:
+            MM_TRACE(MM_TRACE_ERROR, "Unknown option passed to mm_mallopt: %d\n", option);
+            return -1;
+    }
+}
+
+/**
+ * Add up the free blocks of a tree: their count, bytes and the largest.
+ */
+static void tree_stats(const TreeNode* n, struct mm_stats* stats) {
+    for (; n; n = node_right(n)) {
+        tree_stats(n->left, stats);
+        size_t size = n->size & SIZE_MASK;
+        stats->free_blocks++;
+        stats->bytes_free += size;
+        if (size > stats->largest_free)
+            stats->largest_free = size;
+    }
+}
+
+/**
+ * Report usage and event counts. Memory figures are read under each heap's
+ * lock; event counts are the sums of the per-thread counters.
+ */
+void mm_stats(struct mm_stats* stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&arenas_lock);
+    for (unsigned id = 0; id < MM_MAX_HEAPS; id++) {
+        Heap* h = atomic_load_explicit(&heaps[id], memory_order_acquire);
+        if (!h)
+            continue;
+
+        heap_lock(h);
+        stats->bytes_in_use += h->in_use;
+        stats->peak_in_use += h->peak;
+        for (int bin = 0; bin < SMALL_BIN_COUNT; bin++) {
+            for (Block* b = h->bins[bin]; b; b = as_free(b)->next) {
+                stats->free_blocks++;
+                stats->bytes_free += block_size(b);
+                if (block_size(b) > stats->largest_free)
+                    stats->largest_free = block_size(b);
             }
         }
+        tree_stats(h->tree, stats);
+        heap_unlock(h);
     }
+    stats->arenas = arena_count ? arena_count : 1;
+    stats->numa_nodes = numa_nodes;
+    pthread_mutex_unlock(&arenas_lock);
+
+    stats->bytes_in_use += atomic_load_explicit(&mapped_in_use, memory_order_relaxed);
+    stats->peak_in_use += atomic_load_explicit(&mapped_peak, memory_order_relaxed);
+    if (stats->bytes_free)
+        stats->fragmentation = 1.0 - (double)stats->largest_free / (double)stats->bytes_free;
+
+    size_t events[STAT_COUNT] = { 0 };
+    pthread_mutex_lock(&stats_lock);
+    for (ThreadStats* t = &stats_retired; t; t = t == &stats_retired ? stats_threads : t->next) {
+        for (int i = 0; i < STAT_COUNT; i++)
+            events[i] += atomic_load_explicit(&t->events[i], memory_order_relaxed);
+        for (int i = 0; i < MM_STATS_SIZE_CLASSES; i++)
+            stats->size_classes[i] += atomic_load_explicit(&t->sizes[i], memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    stats->mallocs = events[STAT_MALLOC];
+    stats->frees = events[STAT_FREE];
+    stats->reallocs = events[STAT_REALLOC];
+    stats->splits = events[STAT_SPLIT];
+    stats->coalesces = events[STAT_COALESCE];
 }
 
+// Heap walk: a heap is locked only while the next WALK_CHUNK blocks are
+// copied out, and the callback runs on the copies with no lock held. While
+// the lock is free, walk_mark holds the block the walk resumes at;
+// operations that merge that block's header into a block in front of it
+// move the mark back to that block, and trimming moves it to the new
+// epilogue, so the walk always resumes at a real header.
+#define WALK_CHUNK 64
+
+typedef struct WalkRecord {
+    void* ptr;
+    size_t size;
+    bool free;
+} WalkRecord;
 
 /**
- * Reallocate a previously allocated block of memory.
+ * Report every block of one heap to fn, segment by segment in address
+ * order. Returns fn's first nonzero result, which ends the walk, or 0.
  */
-void* mm_realloc(void* ptr, size_t size) {
-    if (!ptr) return mm_malloc(size);
-    if (size == 0) {
-        mm_free(ptr);
-        return NULL;
+static int heap_walk(Heap* h, mm_walk_fn fn, void* ctx) {
+    WalkRecord chunk[WALK_CHUNK];
+    int stop = 0;
+
+    heap_lock(h);
+    Segment* seg = h->segments;
+    Block* block = seg ? (Block*)((char*)seg + SEGMENT_HEADER) : NULL;
+    while (seg && !stop) {
+        unsigned n = 0;
+        while (seg && n < WALK_CHUNK) {
+            size_t size = block_size(block);
+            if (size == 0) { // The epilogue
+                seg = seg->next;
+                block = seg ? (Block*)((char*)seg + SEGMENT_HEADER) : NULL;
+                continue;
+            }
+            bool free = block_is_free(block);
+            chunk[n++] = (WalkRecord){ block_payload(block), free ? size : size - CANARY_SIZE, free };
+            block = next_block(block);
+        }
+        h->walk_mark = block;
+        heap_unlock(h);
+
+        for (unsigned i = 0; i < n && !stop; i++)
+            stop = fn(chunk[i].ptr, chunk[i].size, chunk[i].free, ctx);
+
+        heap_lock(h);
+        block = h->walk_mark;
     }
+    h->walk_mark = NULL;
+    heap_unlock(h);
+    return stop;
+}
 
-    Block* block = (Block*)((char*)ptr - sizeof(Block));
-    if (block->size >= size) return ptr;
+/**
+ * Walk the blocks of every heap: the main heap, the arenas, then the heaps
+ * made by mm_heap_create.
+ */
+int mm_walk(mm_walk_fn fn, void* ctx) {
+    int stop = 0;
+    pthread_mutex_lock(&walk_lock);
+    for (unsigned id = 0; id < MM_MAX_HEAPS && !stop; id++) {
+        Heap* h = atomic_load_explicit(&heaps[id], memory_order_acquire);
+        if (h)
+            stop = heap_walk(h, fn, ctx);
+    }
+    pthread_mutex_unlock(&walk_lock);
+    return stop;
+}
 
-    void* new_ptr = mm_malloc(size);
-    if (new_ptr) {
-        memcpy(new_ptr, ptr, block->size);
-        mm_free(ptr);
+// mm_dump_map and mm_profile_dump write through a buffer on the stack and
+// write(2), so they draw no memory from the allocator being inspected
+typedef struct MapWriter {
+    int fd;
+    bool failed;
+    bool first;                            // No block written yet for this heap
+    size_t len;
+    char buf[4096];
+    size_t counts[2][MM_STATS_SIZE_CLASSES]; // Blocks by [free][size class]
+    size_t bytes[2][MM_STATS_SIZE_CLASSES];
+} MapWriter;
+
+static void map_flush(MapWriter* w) {
+    for (size_t done = 0; done < w->len && !w->failed;) {
+        ssize_t n = write(w->fd, w->buf + done, w->len - done);
+        if (n < 0 && errno != EINTR)
+            w->failed = true;
+        else if (n > 0)
+            done += (size_t)n;
     }
+    w->len = 0;
+}
 
-    return new_ptr;
+static void map_printf(MapWriter* w, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+static void map_printf(MapWriter* w, const char* format, ...) {
+    if (sizeof(w->buf) - w->len < 128)
+        map_flush(w);
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(w->buf + w->len, sizeof(w->buf) - w->len, format, args);
+    va_end(args);
+    if (n > 0)
+        w->len += (size_t)n < sizeof(w->buf) - w->len ? (size_t)n : sizeof(w->buf) - w->len - 1;
+}
+
+static int map_block(void* ptr, size_t size, int free, void* ctx) {
+    MapWriter* w = ctx;
+    map_printf(w, "%s[%zu,%zu,%d]", w->first ? "" : ",", (size_t)(uintptr_t)ptr, size, free);
+    w->first = false;
+    w->counts[free][size_to_stat_class(size)]++;
+    w->bytes[free][size_to_stat_class(size)] += size;
+    return w->failed;
+}
+
+/**
+ * Write the block map of every heap to fd as one JSON object:
+ * {"heaps":[{"id":N,"blocks":[[address,size,free],...]},...],
+ *  "sizes":[{"max":N,"used":N,"used_bytes":N,"free":N,"free_bytes":N},...],
+ *  "mapped_bytes":N}
+ * Sizes are grouped like mm_stats' size classes, the last with "max":null.
+ */
+int mm_dump_map(int fd) {
+    MapWriter w = { .fd = fd };
+    map_printf(&w, "{\"heaps\":[");
+
+    pthread_mutex_lock(&walk_lock);
+    bool first_heap = true;
+    for (unsigned id = 0; id < MM_MAX_HEAPS && !w.failed; id++) {
+        Heap* h = atomic_load_explicit(&heaps[id], memory_order_acquire);
+        if (!h)
+            continue;
+        map_printf(&w, "%s{\"id\":%u,\"blocks\":[", first_heap ? "" : ",", id);
+        first_heap = false;
+        w.first = true;
+        heap_walk(h, map_block, &w);
+        map_printf(&w, "]}");
+    }
+    pthread_mutex_unlock(&walk_lock);
+
+    map_printf(&w, "],\"sizes\":[");
+    bool first_class = true;
+    for (int i = 0; i < MM_STATS_SIZE_CLASSES; i++) {
+        if (!w.counts[0][i] && !w.counts[1][i])
+            continue;
+        if (i + 1 < MM_STATS_SIZE_CLASSES)
+            map_printf(&w, "%s{\"max\":%zu,", first_class ? "" : ",", (size_t)16 << i);
+        else
+            map_printf(&w, "%s{\"max\":null,", first_class ? "" : ",");
+        map_printf(&w, "\"used\":%zu,\"used_bytes\":%zu,\"free\":%zu,\"free_bytes\":%zu}",
+                   w.counts[0][i], w.bytes[0][i], w.counts[1][i], w.bytes[1][i]);
+        first_class = false;
+    }
+    map_printf(&w, "],\"mapped_bytes\":%zu}\n", atomic_load_explicit(&mapped_in_use, memory_order_relaxed));
+    map_flush(&w);
+    return w.failed ? -1 : 0;
+}
+
+/**
+ * Write the sampled blocks still allocated as a pprof heap profile in the
+ * legacy text format, followed by the process mappings pprof needs to
+ * symbolize the addresses. The table is copied first, so sampling goes on
+ * while the profile is written. The alloc columns repeat the in-use ones:
+ * samples are dropped when their block is freed.
+ */
+int mm_profile_dump(int fd) {
+    MapWriter w = { .fd = fd };
+
+    pthread_mutex_lock(&sample_lock);
+    size_t slots = sample_slots, count = sample_count, period = sample_period;
+    Sample* copy = slots ? mmap(NULL, slots * sizeof(Sample), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+                         : NULL;
+    if (copy != MAP_FAILED && copy)
+        memcpy(copy, sample_table, slots * sizeof(Sample));
+    pthread_mutex_unlock(&sample_lock);
+    if (copy == MAP_FAILED)
+        return -1;
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < slots; i++)
+        bytes += copy[i].ptr ? copy[i].size : 0;
+    map_printf(&w, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", count, bytes, count, bytes, period ? period : 1);
+    for (size_t i = 0; i < slots; i++) {
+        if (!copy[i].ptr)
+            continue;
+        map_printf(&w, "1: %zu [1: %zu] @", copy[i].size, copy[i].size);
+        for (unsigned f = 0; f < copy[i].depth; f++)
+            map_printf(&w, " %p", copy[i].stack[f]);
+        map_printf(&w, "\n");
+    }
+    if (copy)
+        munmap(copy, slots * sizeof(Sample));
+
+    map_printf(&w, "\nMAPPED_LIBRARIES:\n");
+    map_flush(&w);
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps < 0)
+        return -1;
+    ssize_t n;
+    while (!w.failed && (n = read(maps, w.buf, sizeof(w.buf))) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            w.failed = true;
+            break;
+        }
+        w.len = (size_t)n;
+        map_flush(&w);
+    }
+    close(maps);
+    return w.failed ? -1 : 0;
+}
+
+/**
+ * Get the number of bytes the block at ptr can hold.
+ */
+size_t mm_usable_size(void* ptr) {
+    if (!ptr)
+        return 0;
+    return block_size((Block*)((char*)ptr - sizeof(Block))) - CANARY_SIZE;
 }
 
 size_t mm_metadata_size() {
-    return sizeof(Block);
+    return sizeof(Block) + CANARY_SIZE;
 }
 
 
@@ -227,7 +3424,17 @@ size_t mm_metadata_size() {
  * Clean up the memory manager (optional for testing purposes).
  */
 void mm_cleanup() {
-    heap_start = NULL;
-    heap_size = 0;
-    heap_count = 0;
+    pthread_mutex_lock(&arenas_lock);
+    arenas_release();
+    arena_count = 0;
+
+    pthread_mutex_lock(&main_heap.lock);
+    atomic_store_explicit(&heaps[0], NULL, memory_order_release);
+    heap_reset(&main_heap);
+    central_reset();
+    sample_drop(0, MM_MAX_ARENAS);
+    atomic_fetch_add_explicit(&heap_epoch, 1, memory_order_release);
+    pthread_mutex_unlock(&main_heap.lock);
+
+    pthread_mutex_unlock(&arenas_lock);
 }
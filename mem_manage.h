@@ -9,16 +9,126 @@ void mm_init(size_t memory_size);
 // Allocate a block of memory
 void* mm_malloc(size_t size);
 
+// Allocate zero-initialized memory for an array of count elements
+void* mm_calloc(size_t count, size_t size);
+
+// Allocate size bytes aligned to alignment, which must be a power of two
+void* mm_aligned_alloc(size_t alignment, size_t size);
+
+// Same as mm_aligned_alloc, under its traditional name
+void* mm_memalign(size_t alignment, size_t size);
+
+// Aligned allocation into *memptr; returns 0, EINVAL or ENOMEM like posix_memalign
+int mm_posix_memalign(void** memptr, size_t alignment, size_t size);
+
 // Free a previously allocated block of memory
 void mm_free(void* ptr);
 
+// Free a block of size bytes, anywhere from the size requested up to
+// mm_usable_size(ptr); faster than mm_free for small blocks
+void mm_free_sized(void* ptr, size_t size);
+
+// Allocate n blocks of size bytes into ptrs under one lock; returns how many
+// were allocated, which is less than n only when memory runs out
+size_t mm_malloc_batch(size_t size, size_t n, void** ptrs);
+
+// Free n blocks, merging neighbours before they reach the free lists; NULLs
+// are skipped and ptrs ends up sorted by address
+void mm_free_batch(void** ptrs, size_t n);
+
 // Reallocate a previously allocated block of memory
 void* mm_realloc(void* ptr, size_t size);
 
+// Get the number of bytes the block at ptr can actually hold
+size_t mm_usable_size(void* ptr);
+
+// Separate heaps: subsystem memory that sits apart from the rest and can be
+// released all at once. Blocks from them work with mm_free, mm_realloc and
+// mm_usable_size like any other; mm_init and mm_cleanup leave them alone.
+typedef struct Heap mm_heap_t;
+
+// Create a heap with an initial size bytes (0 for the default); NULL on failure
+mm_heap_t* mm_heap_create(size_t size);
+
+// Allocate size bytes from heap
+void* mm_heap_malloc(mm_heap_t* heap, size_t size);
+
+// Free every block of heap, and the heap itself
+void mm_heap_destroy(mm_heap_t* heap);
+
 // Clean up the memory manager (optional for testing purposes)
 void mm_cleanup();
 
+// Request size classes in struct mm_stats: class i counts requests of up to
+// 16 << i bytes, the last class all larger ones
+#define MM_STATS_SIZE_CLASSES 20
+
+// Allocator statistics, filled in by mm_stats
+struct mm_stats {
+    size_t bytes_in_use;   // Bytes of allocated blocks, headers included (thread-cached blocks count)
+    size_t peak_in_use;    // Sum of each heap's high-water mark of bytes_in_use
+    size_t bytes_free;     // Payload bytes of all free blocks
+    size_t free_blocks;    // Number of free blocks
+    size_t largest_free;   // Payload bytes of the largest free block
+    double fragmentation;  // External fragmentation: 1 - largest_free / bytes_free
+    size_t mallocs;        // Allocation requests (malloc, calloc, aligned)
+    size_t frees;
+    size_t reallocs;
+    size_t splits;         // Blocks split to serve or trim a request
+    size_t coalesces;      // Merges of a freed block with a free neighbour
+    size_t size_classes[MM_STATS_SIZE_CLASSES]; // Allocation requests by size
+    size_t arenas;         // Arenas threads are spread over, the main heap included
+    size_t numa_nodes;     // Memory nodes the arenas are placed on (1 without NUMA)
+};
+
+// Fill in current allocator statistics; event counts cover the whole process
+void mm_stats(struct mm_stats* stats);
+
+// Called by mm_walk for each block: its payload address and size (the
+// usable size of a block in use) and 1 if it is free; nonzero ends the walk
+typedef int (*mm_walk_fn)(void* ptr, size_t size, int free, void* ctx);
+
+// Report every heap block to fn, locking each heap only a few blocks at a
+// time; returns fn's nonzero result or 0. Thread-cached blocks count as in
+// use, mmapped blocks are not reported, and blocks that change during the
+// walk may be reported again. fn must not walk, dump or destroy heaps.
+int mm_walk(mm_walk_fn fn, void* ctx);
+
+// Write every heap's block map and a summary by size as JSON to fd; 0 or -1
+int mm_dump_map(int fd);
+
+// Record every allocation call to a trace file (see mm_trace.h); returns 0 or -1
+int mm_trace_start(const char* path);
+
+// Write out the calling thread's buffered trace records
+void mm_trace_flush(void);
+
+// Stop recording and close the trace file
+void mm_trace_stop(void);
+
+// Write the sampled blocks still in use, with their allocation stacks, to fd
+// as a pprof heap profile (see MM_OPT_SAMPLE_RATE); returns 0 or -1
+int mm_profile_dump(int fd);
+
 // Get the size of metadata overhead
 size_t mm_metadata_size();
 
+// Return free memory at the heap ends beyond pad bytes, and the unused pages
+// of large free blocks, to the OS; returns 1 if any memory was released
+int mm_trim(size_t pad);
+
+// Parameters accepted by mm_mallopt
+enum {
+    MM_OPT_MMAP_THRESHOLD = 1, // Requests of at least this many bytes are mmapped (default 256 KiB)
+    MM_OPT_DECOMMIT_THRESHOLD, // Decommit free blocks that grow this large by merging (default 1 MiB, 0 = off)
+    MM_OPT_DECOMMIT_INTERVAL,  // Run mm_trim(0) in a background thread every this many ms (0 = stop)
+    MM_OPT_QUARANTINE,         // Freed blocks each thread holds back from reuse (hardened builds only, max 128)
+    MM_OPT_HUGE_PAGES,         // Back heaps set up from now on with huge pages of this size, e.g. 2 MiB (0 = off)
+    MM_OPT_CACHE_ISOLATION,    // 1 = small blocks of different threads never share a cache line
+    MM_OPT_SAMPLE_RATE,        // Sample an allocation about every this many bytes for mm_profile_dump (0 = off)
+};
+
+// Set an allocator parameter; returns 0 on success, -1 on an invalid option or value
+int mm_mallopt(int option, size_t value);
+
 #endif // MEM_MANAGE_H
@@ -0,0 +1,135 @@
+#include "mm_arena.h"
+#include "mem_manage.h"
+#include <stdint.h>
+
+// Chunks are regular heap blocks; the default stays below the size that
+// would be served by a separate mapping
+#define DEFAULT_CHUNK_SIZE ((size_t)64 * 1024)
+
+// Allocations keep the alignment mm_malloc gives
+#define ARENA_ALIGN 8
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct Chunk {
+    struct Chunk* next;  // Older chunk of the same arena
+    size_t size;         // Usable bytes after the header
+} Chunk;
+
+#define CHUNK_HEADER ARENA_ROUND(sizeof(Chunk))
+
+struct mm_arena {
+    size_t chunk_size;   // Usable bytes of a regular chunk
+    Chunk* chunks;       // Newest first, oversized chunks behind the current one
+    Chunk* first;        // The chunk made with the arena, which survives resets
+    char* bump;          // Next free byte in the current chunk
+    char* end;           // End of the current chunk
+};
+
+static Chunk* chunk_new(mm_arena_t* arena, size_t size) {
+    Chunk* chunk = mm_malloc(CHUNK_HEADER + size);
+    if (!chunk)
+        return NULL;
+    chunk->size = size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    return chunk;
+}
+
+/**
+ * Create an arena that grows in chunks of chunk_size bytes.
+ */
+mm_arena_t* mm_arena_create(size_t chunk_size) {
+    if (chunk_size == 0)
+        chunk_size = DEFAULT_CHUNK_SIZE - CHUNK_HEADER;
+    if (chunk_size > SIZE_MAX / 2)
+        return NULL;
+
+    mm_arena_t* arena = mm_malloc(sizeof(*arena));
+    if (!arena)
+        return NULL;
+
+    arena->chunk_size = ARENA_ROUND(chunk_size);
+    arena->chunks = NULL;
+    Chunk* first = chunk_new(arena, arena->chunk_size);
+    if (!first) {
+        mm_free(arena);
+        return NULL;
+    }
+    arena->first = first;
+    arena->bump = (char*)first + CHUNK_HEADER;
+    arena->end = arena->bump + first->size;
+    return arena;
+}
+
+/**
+ * Allocate size bytes by bumping a pointer through the current chunk.
+ * Requests bigger than a quarter chunk get a chunk of their own, so they
+ * do not waste the rest of the current one.
+ */
+void* mm_arena_alloc(mm_arena_t* arena, size_t size) {
+    if (size == 0 || size > SIZE_MAX / 2)
+        return NULL;
+    size = ARENA_ROUND(size);
+
+    if ((size_t)(arena->end - arena->bump) >= size) {
+        void* ptr = arena->bump;
+        arena->bump += size;
+        return ptr;
+    }
+
+    if (size > arena->chunk_size / 4) {
+        // Insert behind the current chunk so bumping carries on there
+        Chunk* current = arena->chunks;
+        Chunk* chunk = mm_malloc(CHUNK_HEADER + size);
+        if (!chunk)
+            return NULL;
+        chunk->size = size;
+        chunk->next = current->next;
+        current->next = chunk;
+        return (char*)chunk + CHUNK_HEADER;
+    }
+
+    Chunk* chunk = chunk_new(arena, arena->chunk_size);
+    if (!chunk)
+        return NULL;
+    arena->bump = (char*)chunk + CHUNK_HEADER + size;
+    arena->end = (char*)chunk + CHUNK_HEADER + chunk->size;
+    return (char*)chunk + CHUNK_HEADER;
+}
+
+/**
+ * Free everything allocated from the arena. The first chunk is kept so a
+ * reused arena does not go back to the heap for its first allocations;
+ * it need not be the oldest in the list, as an oversized chunk can be
+ * linked behind it.
+ */
+void mm_arena_reset(mm_arena_t* arena) {
+    Chunk* chunk = arena->chunks;
+    while (chunk) {
+        Chunk* next = chunk->next;
+        if (chunk != arena->first)
+            mm_free(chunk);
+        chunk = next;
+    }
+    Chunk* first = arena->first;
+    first->next = NULL;
+    arena->chunks = first;
+    arena->bump = (char*)first + CHUNK_HEADER;
+    arena->end = arena->bump + first->size;
+}
+
+/**
+ * Release all memory of the arena, and the arena itself.
+ */
+void mm_arena_destroy(mm_arena_t* arena) {
+    if (!arena)
+        return;
+
+    Chunk* chunk = arena->chunks;
+    while (chunk) {
+        Chunk* next = chunk->next;
+        mm_free(chunk);
+        chunk = next;
+    }
+    mm_free(arena);
+}
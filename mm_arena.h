@@ -0,0 +1,23 @@
+#ifndef MM_ARENA_H
+#define MM_ARENA_H
+
+#include <stddef.h> // for size_t
+
+// Bump-pointer region for allocations that all die together, such as the
+// work of one request. Individual objects are never freed; mm_arena_reset
+// releases everything at once. An arena is not thread-safe.
+typedef struct mm_arena mm_arena_t;
+
+// Create an arena that grows in chunks of chunk_size bytes (0 for the default)
+mm_arena_t* mm_arena_create(size_t chunk_size);
+
+// Allocate size bytes from the arena
+void* mm_arena_alloc(mm_arena_t* arena, size_t size);
+
+// Free everything allocated from the arena, keeping its first chunk for reuse
+void mm_arena_reset(mm_arena_t* arena);
+
+// Release all memory of the arena, and the arena itself
+void mm_arena_destroy(mm_arena_t* arena);
+
+#endif // MM_ARENA_H
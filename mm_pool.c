@@ -0,0 +1,110 @@
+#include "mm_pool.h"
+#include "mem_manage.h"
+#include <stdint.h>
+
+// Slabs are regular heap blocks just below the smallest size that would be
+// served by a separate mapping. Each holds at least MIN_OBJECTS objects.
+#define SLAB_SIZE ((size_t)64 * 1024)
+#define MIN_OBJECTS 8
+
+// Objects keep the alignment mm_malloc gives
+#define OBJ_ALIGN 8
+
+typedef struct Slab {
+    struct Slab* next;  // Next slab of the same pool
+} Slab;
+
+// Free objects are chained through their first word
+typedef struct FreeObject {
+    struct FreeObject* next;
+} FreeObject;
+
+struct mm_pool {
+    size_t obj_size;       // Object size, rounded for alignment
+    size_t slab_bytes;     // Bytes requested from mm_malloc per slab
+    Slab* slabs;           // Every slab owned by the pool
+    FreeObject* free_list; // Objects returned with mm_pool_free
+    char* bump;            // Next never-used object in the newest slab
+    char* bump_end;        // End of the newest slab
+};
+
+#define SLAB_HEADER (((sizeof(Slab)) + OBJ_ALIGN - 1) & ~(size_t)(OBJ_ALIGN - 1))
+
+/**
+ * Create a pool handing out objects of obj_size bytes.
+ */
+mm_pool_t* mm_pool_create(size_t obj_size) {
+    if (obj_size == 0 || obj_size > SIZE_MAX / (2 * MIN_OBJECTS))
+        return NULL;
+
+    mm_pool_t* pool = mm_malloc(sizeof(*pool));
+    if (!pool)
+        return NULL;
+
+    if (obj_size < sizeof(FreeObject))
+        obj_size = sizeof(FreeObject);
+    pool->obj_size = (obj_size + OBJ_ALIGN - 1) & ~(size_t)(OBJ_ALIGN - 1);
+
+    pool->slab_bytes = SLAB_SIZE;
+    if (pool->slab_bytes < SLAB_HEADER + MIN_OBJECTS * pool->obj_size)
+        pool->slab_bytes = SLAB_HEADER + MIN_OBJECTS * pool->obj_size;
+
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->bump = pool->bump_end = NULL;
+    return pool;
+}
+
+/**
+ * Allocate one object: reuse a freed one, else carve the next one from
+ * the newest slab, else start a new slab.
+ */
+void* mm_pool_alloc(mm_pool_t* pool) {
+    FreeObject* obj = pool->free_list;
+    if (obj) {
+        pool->free_list = obj->next;
+        return obj;
+    }
+
+    if ((size_t)(pool->bump_end - pool->bump) < pool->obj_size) {
+        Slab* slab = mm_malloc(pool->slab_bytes);
+        if (!slab)
+            return NULL;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->bump = (char*)slab + SLAB_HEADER;
+        pool->bump_end = (char*)slab + pool->slab_bytes;
+    }
+
+    void* ptr = pool->bump;
+    pool->bump += pool->obj_size;
+    return ptr;
+}
+
+/**
+ * Return an object to its pool.
+ */
+void mm_pool_free(mm_pool_t* pool, void* ptr) {
+    if (!ptr)
+        return;
+
+    FreeObject* obj = ptr;
+    obj->next = pool->free_list;
+    pool->free_list = obj;
+}
+
+/**
+ * Release every slab of the pool, and the pool itself.
+ */
+void mm_pool_destroy(mm_pool_t* pool) {
+    if (!pool)
+        return;
+
+    Slab* slab = pool->slabs;
+    while (slab) {
+        Slab* next = slab->next;
+        mm_free(slab);
+        slab = next;
+    }
+    mm_free(pool);
+}
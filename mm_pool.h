@@ -0,0 +1,23 @@
+#ifndef MM_POOL_H
+#define MM_POOL_H
+
+#include <stddef.h> // for size_t
+
+// Fixed-size object pool. Objects are packed into slabs carved from the
+// managed heap and carry no per-object header. A pool is not thread-safe;
+// use one pool per thread or lock around it.
+typedef struct mm_pool mm_pool_t;
+
+// Create a pool handing out objects of obj_size bytes
+mm_pool_t* mm_pool_create(size_t obj_size);
+
+// Allocate one object from the pool
+void* mm_pool_alloc(mm_pool_t* pool);
+
+// Return an object to the pool it was allocated from
+void mm_pool_free(mm_pool_t* pool, void* ptr);
+
+// Release every slab of the pool, and the pool itself
+void mm_pool_destroy(mm_pool_t* pool);
+
+#endif // MM_POOL_H
@@ -0,0 +1,80 @@
+#include "mem_manage.h"
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+// Standard allocation entry points backed by the memory manager, built
+// into libmm.so so unmodified programs can run with LD_PRELOAD=./libmm.so.
+// The heap initializes itself on the first call. Unlike mm_malloc, the C
+// library functions return a unique pointer for zero-sized requests and
+// set errno when they fail.
+//
+// MM_TRACE_FILE=<path> in the environment records an allocation trace of
+// the whole program for replay with bench_mm/bench_system.
+
+__attribute__((constructor)) static void preload_init(void) {
+    const char* path = getenv("MM_TRACE_FILE");
+    if (path && mm_trace_start(path) == 0)
+        atexit(mm_trace_stop);
+}
+
+static void* check(void* ptr) {
+    if (!ptr)
+        errno = ENOMEM;
+    return ptr;
+}
+
+void* malloc(size_t size) {
+    return check(mm_malloc(size ? size : 1));
+}
+
+void free(void* ptr) {
+    if (ptr)
+        mm_free(ptr);
+}
+
+// C23 sized deallocation
+void free_sized(void* ptr, size_t size) {
+    if (ptr)
+        mm_free_sized(ptr, size ? size : 1);
+}
+
+void* calloc(size_t count, size_t size) {
+    if (count == 0 || size == 0)
+        return check(mm_calloc(1, 1));
+    return check(mm_calloc(count, size));
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (!ptr)
+        return malloc(size);
+    if (size == 0) {
+        mm_free(ptr);
+        return NULL;
+    }
+    return check(mm_realloc(ptr, size));
+}
+
+void* memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return check(mm_memalign(alignment, size ? size : 1));
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    return mm_posix_memalign(memptr, alignment, size ? size : 1);
+}
+
+void* valloc(size_t size) {
+    return memalign((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+size_t malloc_usable_size(void* ptr) {
+    return mm_usable_size(ptr);
+}
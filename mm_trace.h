@@ -0,0 +1,37 @@
+#ifndef MM_TRACE_H
+#define MM_TRACE_H
+
+#include <stdint.h>
+
+// Allocation traces written by mm_trace_start: a header, then one record
+// per call in the order each thread's buffer was written out (sort by
+// time_ns to get the call order across threads). Pointers are the
+// addresses seen by the traced program and only serve to match calls up.
+
+#define MM_TRACE_MAGIC "MMTRACE"
+#define MM_TRACE_VERSION 1
+
+enum {
+    MM_OP_MALLOC = 1,  // ptr = mm_malloc(size)
+    MM_OP_CALLOC,      // ptr = mm_calloc(...), size is the total
+    MM_OP_ALIGNED,     // ptr = mm_aligned_alloc(old, size): old holds the alignment
+    MM_OP_FREE,        // mm_free(old)
+    MM_OP_REALLOC,     // ptr = mm_realloc(old, size)
+};
+
+struct mm_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;  // sizeof(struct mm_trace_record)
+};
+
+struct mm_trace_record {
+    uint64_t time_ns;  // Since mm_trace_start; allocations stamp their return, frees their start
+    uint64_t ptr;      // Returned block, 0 if the call failed
+    uint64_t old;      // Block passed in
+    uint64_t size;     // Requested size
+    uint32_t thread;   // Small number of the calling thread
+    uint32_t op;       // MM_OP_*
+};
+
+#endif // MM_TRACE_H
@@ -1,14 +1,43 @@
 #include "mem_manage.h"
+#include "mm_pool.h"
+#include "mm_arena.h"
+#include "mm_trace.h"
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h> // For atoi
+#include <pthread.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #ifdef USE_SYSTEM_MALLOC
     #include <stdlib.h> // For malloc, free, realloc
+    #include <malloc.h> // For malloc_usable_size
     #define mm_malloc malloc
+    #define mm_calloc calloc
     #define mm_free free
     #define mm_realloc realloc
+    #define mm_aligned_alloc aligned_alloc
+    #define mm_posix_memalign posix_memalign
+    #define mm_usable_size malloc_usable_size
+    #define mm_free_sized(ptr, size) free(ptr)
+    #define mm_malloc_batch system_malloc_batch
+    #define mm_free_batch system_free_batch
+    static size_t mm_malloc_batch(size_t size, size_t n, void** ptrs) {
+        size_t count = 0;
+        while (size && count < n && (ptrs[count] = malloc(size)))
+            count++;
+        return count;
+    }
+    static void mm_free_batch(void** ptrs, size_t n) {
+        for (size_t i = 0; i < n; i++)
+            free(ptrs[i]);
+    }
     #define mm_init(size) ((void)0) // No-op for system malloc
     #define mm_cleanup() ((void)0) // No-op for system malloc
     #define mm_metadata_size() 0   // No metadata for system malloc
@@ -41,6 +70,36 @@ void test_realloc() {
     printf("\ntest_realloc PASSED\n\n");
 }
 
+void test_realloc_in_place() {
+    mm_init(1 << 16);
+    unsigned char* ptr = mm_malloc(1000);
+    void* next = mm_malloc(1000);
+    void* guard = mm_malloc(1000);
+    assert(ptr != NULL && next != NULL && guard != NULL);
+    memset(ptr, 0x11, 1000);
+
+    // The block right after ptr is free, so growing must not move it
+    mm_free(next);
+    unsigned char* grown = mm_realloc(ptr, 1800);
+    assert(grown != NULL);
+    assert(grown[0] == 0x11 && grown[999] == 0x11);
+#ifndef USE_SYSTEM_MALLOC
+    assert(grown == ptr);
+#endif
+
+    // Shrinking splits off the tail in place
+    unsigned char* shrunk = mm_realloc(grown, 200);
+    assert(shrunk != NULL && shrunk[199] == 0x11);
+#ifndef USE_SYSTEM_MALLOC
+    assert(shrunk == ptr);
+#endif
+
+    mm_free(shrunk);
+    mm_free(guard);
+    mm_cleanup();
+    printf("\ntest_realloc_in_place PASSED\n\n");
+}
+
 void test_free_and_coalesce() {
     mm_init(1024);
     void* ptr1 = mm_malloc(100);
@@ -51,6 +110,11 @@ void test_free_and_coalesce() {
     mm_free(ptr1);
     mm_free(ptr3);
 
+    // Merging in both directions leaves one block spanning the whole heap
+    void* whole = mm_malloc(1024 - mm_metadata_size());
+    assert(whole != NULL);
+    mm_free(whole);
+
     mm_cleanup();
     printf("\ntest_free_and_coalesce PASSED\n\n");
 }
@@ -80,6 +144,933 @@ void test_exact_size_allocation() {
     printf("\ntest_exact_size_allocation PASSED\n\n");
 }
 
+void test_header_overhead() {
+#ifndef USE_SYSTEM_MALLOC
+    mm_init(1 << 16);
+
+    // A block costs one header word, plus its canary in hardened builds;
+    // neighbours sit right behind each other
+    int hardened = mm_mallopt(MM_OPT_QUARANTINE, 0) == 0;
+    assert(mm_metadata_size() == (hardened ? 2 : 1) * sizeof(size_t));
+    char* first = mm_malloc(600);
+    char* second = mm_malloc(600);
+    assert(first != NULL && second == first + 600 + mm_metadata_size());
+
+    mm_free(first);
+    mm_free(second);
+    mm_cleanup();
+#endif
+    printf("\ntest_header_overhead PASSED\n\n");
+}
+
+void test_aligned_alloc() {
+    mm_init(1 << 16);
+    size_t alignments[] = { 16, 64, 4096 };
+    size_t sizes[] = { 1, 100, 1000, 5000 };
+
+    for (int a = 0; a < 3; a++) {
+        for (int s = 0; s < 4; s++) {
+            char* ptr = mm_aligned_alloc(alignments[a], sizes[s]);
+            assert(ptr != NULL);
+            assert((uintptr_t)ptr % alignments[a] == 0);
+            memset(ptr, 0x5A, sizes[s]);
+            mm_free(ptr);
+        }
+    }
+
+    // Large enough for a mapping of its own
+    char* big = mm_aligned_alloc(4096, 1 << 20);
+    assert(big != NULL && (uintptr_t)big % 4096 == 0);
+    memset(big, 0x5A, 1 << 20);
+    mm_free(big);
+
+    void* ptr = NULL;
+    assert(mm_posix_memalign(&ptr, 64, 256) == 0);
+    assert(ptr != NULL && (uintptr_t)ptr % 64 == 0);
+    mm_free(ptr);
+    assert(mm_posix_memalign(&ptr, 24, 256) == EINVAL);
+    assert(mm_posix_memalign(&ptr, 0, 256) == EINVAL);
+
+#ifndef USE_SYSTEM_MALLOC
+    // The padding in front of an aligned block goes back to the heap, so
+    // a heap that is otherwise empty can still be allocated as a whole
+    mm_cleanup();
+    mm_init(1 << 16);
+    void* aligned = mm_aligned_alloc(4096, 64);
+    assert(aligned != NULL);
+    mm_free(aligned);
+    void* whole = mm_malloc((1 << 16) - mm_metadata_size());
+    assert(whole != NULL);
+    mm_free(whole);
+    mm_cleanup();
+#endif
+    printf("\ntest_aligned_alloc PASSED\n\n");
+}
+
+void test_lazy_init() {
+    // No mm_init: the first allocation sets up a default heap
+    mm_cleanup();
+    char* ptr = mm_malloc(100);
+    assert(ptr != NULL);
+    memset(ptr, 0x11, 100);
+#ifndef USE_SYSTEM_MALLOC
+    assert(mm_usable_size(ptr) >= 100);
+#endif
+    mm_free(ptr);
+    mm_cleanup();
+    printf("\ntest_lazy_init PASSED\n\n");
+}
+
+static void* fork_worker(void* arg) {
+    for (int i = 0; i < 20000; i++) {
+        mm_free(mm_malloc((size_t)(i % 1000) + 1));
+#ifndef USE_SYSTEM_MALLOC
+        if (i % 500 == 0) {
+            struct mm_stats stats;
+            mm_stats(&stats);
+        }
+#endif
+    }
+    return arg;
+}
+
+void test_fork() {
+    mm_init(1 << 16);
+#ifndef USE_SYSTEM_MALLOC
+    // The worker's trace buffer fills up and is written out while forking
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mm_fork_trace_%d", (int)getpid());
+    assert(mm_trace_start(path) == 0);
+#endif
+    pthread_t thread;
+    pthread_create(&thread, NULL, fork_worker, NULL);
+
+    // The child must find the heap usable whatever the worker was doing
+    for (int i = 0; i < 20; i++) {
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            void* ptr = mm_malloc(2000);
+            mm_free(mm_malloc(100));
+#ifndef USE_SYSTEM_MALLOC
+            struct mm_stats stats;
+            mm_stats(&stats);
+            mm_trace_stop();
+#endif
+            _exit(ptr ? 0 : 1);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    pthread_join(thread, NULL);
+#ifndef USE_SYSTEM_MALLOC
+    mm_trace_stop();
+    remove(path);
+#endif
+    mm_cleanup();
+    printf("\ntest_fork PASSED\n\n");
+}
+
+void test_stats() {
+#ifndef USE_SYSTEM_MALLOC
+    mm_init(1 << 16);
+    struct mm_stats before, after;
+    mm_stats(&before);
+    assert(before.bytes_in_use == 0 && before.free_blocks == 1);
+    assert(before.fragmentation == 0.0);
+
+    // Free every other block so the free space is scattered
+    void* ptrs[16];
+    for (int i = 0; i < 16; i++)
+        ptrs[i] = mm_malloc(1000);
+    for (int i = 0; i < 16; i += 2)
+        mm_free(ptrs[i]);
+    ptrs[1] = mm_realloc(ptrs[1], 600);
+
+    mm_stats(&after);
+    assert(after.mallocs - before.mallocs == 16);
+    assert(after.frees - before.frees == 8);
+    assert(after.reallocs - before.reallocs == 1);
+    assert(after.size_classes[6] - before.size_classes[6] == 16); // 513..1024 bytes
+    assert(after.splits > before.splits);
+    assert(after.bytes_in_use >= 7 * 1000 + 600 && after.bytes_in_use < 8 * 1024);
+    assert(after.peak_in_use >= 16 * 1000);
+    assert(after.free_blocks >= 9 && after.fragmentation > 0.0);
+
+    // Everything merges back into one block
+    for (int i = 1; i < 16; i += 2)
+        mm_free(ptrs[i]);
+    mm_stats(&after);
+    assert(after.bytes_in_use == 0 && after.free_blocks == 1);
+    assert(after.coalesces > before.coalesces);
+    mm_cleanup();
+#endif
+    printf("\ntest_stats PASSED\n\n");
+}
+
+#ifndef USE_SYSTEM_MALLOC
+static void* trace_worker(void* arg) {
+    for (int i = 0; i < 5000; i++)
+        mm_free(mm_malloc(32));
+    return arg;
+}
+#endif
+
+void test_trace() {
+#ifndef USE_SYSTEM_MALLOC
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mm_trace_test_%d", (int)getpid());
+    mm_init(1 << 16);
+    assert(mm_trace_start(path) == 0);
+
+    void* ptr = mm_malloc(100);
+    ptr = mm_realloc(ptr, 2000);
+    mm_free(ptr);
+    pthread_t thread;
+    pthread_create(&thread, NULL, trace_worker, NULL);
+    pthread_join(thread, NULL); // Flushes the worker's records as it exits
+    mm_trace_stop();
+    mm_free(mm_malloc(100)); // Not recorded any more
+
+    FILE* file = fopen(path, "rb");
+    assert(file != NULL);
+    struct mm_trace_header header;
+    assert(fread(&header, sizeof(header), 1, file) == 1);
+    assert(memcmp(header.magic, MM_TRACE_MAGIC, sizeof(MM_TRACE_MAGIC)) == 0);
+    assert(header.record_size == sizeof(struct mm_trace_record));
+
+    // The calling thread's three calls, then the worker's allocations and frees
+    struct mm_trace_record r;
+    size_t counts[MM_OP_REALLOC + 1] = { 0 };
+    uint64_t realloc_old = 0, first_ptr = 0;
+    while (fread(&r, sizeof(r), 1, file) == 1) {
+        assert(r.op >= MM_OP_MALLOC && r.op <= MM_OP_REALLOC);
+        counts[r.op]++;
+        if (r.op == MM_OP_MALLOC && r.size == 100)
+            first_ptr = r.ptr;
+        if (r.op == MM_OP_REALLOC)
+            realloc_old = r.old;
+    }
+    fclose(file);
+    remove(path);
+    assert(counts[MM_OP_MALLOC] == 5001 && counts[MM_OP_FREE] == 5001 && counts[MM_OP_REALLOC] == 1);
+    assert(first_ptr != 0 && realloc_old == first_ptr);
+    mm_cleanup();
+#endif
+    printf("\ntest_trace PASSED\n\n");
+}
+
+#ifndef USE_SYSTEM_MALLOC
+static size_t resident_bytes() {
+    size_t pages = 0, resident = 0;
+    FILE* file = fopen("/proc/self/statm", "r");
+    assert(file != NULL);
+    assert(fscanf(file, "%zu %zu", &pages, &resident) == 2);
+    fclose(file);
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+#endif
+
+void test_trim() {
+#ifndef USE_SYSTEM_MALLOC
+    const size_t big = 8 << 20;
+    mm_init(1 << 16);
+    mm_mallopt(MM_OPT_MMAP_THRESHOLD, 64 << 20); // Keep the block in the heap
+    mm_mallopt(MM_OPT_DECOMMIT_THRESHOLD, 0);
+
+    // Nothing goes back to the OS on free; mm_trim releases it
+    char* ptr = mm_malloc(big);
+    assert(ptr != NULL);
+    memset(ptr, 1, big);
+    mm_free(ptr);
+    size_t before = resident_bytes();
+    assert(mm_trim(0) == 1);
+    assert(resident_bytes() + big * 3 / 4 < before);
+
+    // The heap still works after trimming
+    ptr = mm_malloc(big);
+    assert(ptr != NULL);
+    memset(ptr, 2, big);
+    mm_free(ptr);
+
+    // The background thread does the same after a while
+    before = resident_bytes();
+    assert(mm_mallopt(MM_OPT_DECOMMIT_INTERVAL, 10) == 0);
+    for (int i = 0; i < 200 && resident_bytes() + big * 3 / 4 >= before; i++)
+        usleep(10000);
+    assert(resident_bytes() + big * 3 / 4 < before);
+    assert(mm_mallopt(MM_OPT_DECOMMIT_INTERVAL, 0) == 0);
+
+    // A heap that grew in many pieces, which the kernel rarely places next
+    // to each other, gets the pieces that became entirely free unmapped
+    mm_heap_t* heap = mm_heap_create(0);
+    void* blocks[200];
+    for (int i = 0; i < 200; i++) {
+        blocks[i] = mm_heap_malloc(heap, 60000);
+        assert(blocks[i] != NULL);
+        memset(blocks[i], 3, 60000);
+    }
+    for (int i = 0; i < 200; i++)
+        mm_free(blocks[i]);
+    assert(mm_trim(0) == 1);
+    struct mm_stats stats;
+    mm_stats(&stats);
+    assert(stats.free_blocks < 20 && stats.bytes_free < 1 << 20);
+    ptr = mm_heap_malloc(heap, 60000);
+    assert(ptr != NULL);
+    memset(ptr, 4, 60000);
+    mm_heap_destroy(heap);
+
+    mm_mallopt(MM_OPT_MMAP_THRESHOLD, 256 * 1024);
+    mm_mallopt(MM_OPT_DECOMMIT_THRESHOLD, 1024 * 1024);
+    mm_cleanup();
+#endif
+    printf("\ntest_trim PASSED\n\n");
+}
+
+#ifndef USE_SYSTEM_MALLOC
+// Run misuse in a child process, which must die with SIGABRT
+static void expect_abort(void (*misuse)(void)) {
+    fflush(stdout);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        close(STDERR_FILENO);
+        misuse();
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+static void small_double_free() {
+    void* ptr = mm_malloc(40);
+    mm_free(ptr);
+    mm_free(ptr);
+}
+
+static void large_double_free() {
+    void* ptr = mm_malloc(5000);
+    mm_free(ptr);
+    mm_free(ptr);
+}
+
+static void overflow() {
+    char* ptr = mm_malloc(100);
+    memset(ptr, 0, 101 + sizeof(size_t));
+    mm_free(ptr);
+}
+
+static void interior_free() {
+    char* ptr = mm_malloc(100);
+    mm_free(ptr + 32);
+}
+
+static void write_after_free() {
+    char* ptr = mm_malloc(100);
+    mm_free(ptr);
+    ptr[40] = 1;
+    for (int i = 0; i < 16; i++)
+        mm_free(mm_malloc(100));
+}
+
+// Looks like a block of the main heap, but lies outside of it
+static size_t foreign_block[8] = { 32 };
+
+static void foreign_realloc() {
+    mm_realloc(foreign_block + 1, 100);
+}
+#endif
+
+void test_hardened() {
+#ifndef USE_SYSTEM_MALLOC
+    // Only hardened builds have a quarantine to configure
+    if (mm_mallopt(MM_OPT_QUARANTINE, 16) == 0) {
+        mm_init(1 << 16);
+        expect_abort(small_double_free);
+        expect_abort(large_double_free);
+        expect_abort(overflow);
+        expect_abort(interior_free);
+        expect_abort(write_after_free);
+        expect_abort(foreign_realloc);
+
+        // Correct use goes through the quarantine untouched
+        for (int i = 0; i < 64; i++)
+            mm_free(mm_malloc(100 + i * 50));
+        mm_mallopt(MM_OPT_QUARANTINE, 0);
+        mm_cleanup();
+    } else {
+        // Without hardening, a foreign pointer is reported and left alone
+        mm_init(1 << 16);
+        assert(mm_realloc(foreign_block + 1, 100) == NULL);
+        mm_free(foreign_block + 1);
+        assert(foreign_block[0] == 32);
+        mm_cleanup();
+    }
+#endif
+    printf("\ntest_hardened PASSED\n\n");
+}
+
+void test_sized_free() {
+    mm_init(1 << 16);
+
+    // The usable size covers the request and can all be written
+    char* ptr = mm_malloc(100);
+    size_t usable = mm_usable_size(ptr);
+    assert(ptr != NULL && usable >= 100);
+    memset(ptr, 1, usable);
+    mm_free_sized(ptr, 100);
+
+    // Small blocks go straight back for reuse; any size up to the usable
+    // one is accepted
+    char* again = mm_malloc(100);
+#ifndef USE_SYSTEM_MALLOC
+    assert(usable == 104 && again == ptr);
+#endif
+    mm_free_sized(again, usable);
+
+    // Large and mapped blocks take the regular path
+    char* large = mm_malloc(5000);
+    char* mapped = mm_malloc(1 << 20);
+    assert(large != NULL && mapped != NULL);
+    assert(mm_usable_size(large) >= 5000 && mm_usable_size(mapped) >= 1 << 20);
+    mm_free_sized(large, 5000);
+    mm_free_sized(mapped, 1 << 20);
+    mm_free_sized(NULL, 0);
+
+    mm_cleanup();
+    printf("\ntest_sized_free PASSED\n\n");
+}
+
+void test_batch() {
+    mm_init(1 << 16);
+    void* ptrs[500];
+
+    // A batch is a run of neighbours, each usable on its own
+    assert(mm_malloc_batch(100, 500, ptrs) == 500);
+    for (int i = 0; i < 500; i++) {
+        assert(ptrs[i] != NULL);
+        memset(ptrs[i], i & 0xFF, 100);
+    }
+    for (int i = 0; i < 500; i++)
+        assert(((unsigned char*)ptrs[i])[99] == (i & 0xFF));
+#ifndef USE_SYSTEM_MALLOC
+    assert((char*)ptrs[1] == (char*)ptrs[0] + 104 + mm_metadata_size());
+#endif
+
+    // Freed in any order, the run merges back into one free block
+    for (int i = 0; i < 250; i++) {
+        void* tmp = ptrs[i];
+        ptrs[i] = ptrs[499 - i];
+        ptrs[499 - i] = tmp;
+    }
+    void* last = ptrs[7];
+    ptrs[7] = NULL;
+    mm_free_batch(ptrs, 500);
+    mm_free_batch(&last, 1);
+#ifndef USE_SYSTEM_MALLOC
+    // (Hardened builds free one by one, through the thread cache)
+    struct mm_stats stats;
+    mm_stats(&stats);
+    assert(mm_mallopt(MM_OPT_QUARANTINE, 0) == 0 || (stats.bytes_in_use == 0 && stats.free_blocks <= 2));
+#endif
+
+    // Large and mapped blocks work too
+    assert(mm_malloc_batch(5000, 4, ptrs) == 4);
+    assert(mm_malloc_batch(1 << 20, 2, ptrs + 4) == 2);
+    memset(ptrs[5], 1, 1 << 20);
+    mm_free_batch(ptrs, 6);
+    assert(mm_malloc_batch(0, 4, ptrs) == 0);
+
+    mm_cleanup();
+    printf("\ntest_batch PASSED\n\n");
+}
+
+void test_heap_instances() {
+#ifndef USE_SYSTEM_MALLOC
+    mm_init(1 << 16);
+    struct mm_stats before, after;
+    mm_stats(&before);
+
+    mm_heap_t* first = mm_heap_create(1 << 16);
+    mm_heap_t* second = mm_heap_create(0);
+    assert(first != NULL && second != NULL && first != second);
+
+    // Heaps grow past their initial size, large blocks included
+    void* ptrs[1000];
+    for (int i = 0; i < 1000; i++) {
+        ptrs[i] = mm_heap_malloc(i % 2 ? first : second, 100 + i);
+        assert(ptrs[i] != NULL);
+        memset(ptrs[i], i & 0xFF, 100 + i);
+    }
+    char* large = mm_heap_malloc(first, 1 << 20);
+    assert(large != NULL);
+    memset(large, 1, 1 << 20);
+
+    // Their blocks can be freed and resized one by one, and are never
+    // handed out by the default heap
+    mm_free(ptrs[1]);
+    void* other = mm_malloc(101);
+    assert(other != ptrs[1]);
+    mm_free(other);
+    ptrs[3] = mm_realloc(ptrs[3], 5000);
+    assert(ptrs[3] != NULL && ((unsigned char*)ptrs[3])[102] == 3);
+    assert(mm_usable_size(ptrs[5]) >= 105);
+
+    // Destroying a heap frees all of it, and only it
+    mm_heap_destroy(first);
+    for (int i = 0; i < 1000; i += 2)
+        assert(((unsigned char*)ptrs[i])[99 + i] == (i & 0xFF));
+    mm_heap_destroy(second);
+    mm_trim(0); // Also flushes the thread cache, which holds other
+    mm_stats(&after);
+    assert(after.bytes_in_use == before.bytes_in_use);
+
+    void* ptr = mm_malloc(100);
+    assert(ptr != NULL);
+    mm_free(ptr);
+    mm_cleanup();
+#endif
+    printf("\ntest_heap_instances PASSED\n\n");
+}
+
+void test_huge_pages() {
+#ifndef USE_SYSTEM_MALLOC
+    const size_t huge = 2 << 20;
+    assert(mm_mallopt(MM_OPT_HUGE_PAGES, 3 << 20) == -1);
+    assert(mm_mallopt(MM_OPT_HUGE_PAGES, huge) == 0);
+    mm_mallopt(MM_OPT_MMAP_THRESHOLD, 64 << 20); // Keep the block in the heap
+    mm_mallopt(MM_OPT_DECOMMIT_THRESHOLD, 0);
+    mm_init(1 << 16);
+
+    // The heap starts on a huge page boundary, with or without huge pages
+    // available, and grows by whole huge pages
+    char* small = mm_malloc(100);
+    assert(small != NULL && ((uintptr_t)small & (huge - 1)) < 4096);
+    char* big = mm_malloc(3 * huge);
+    assert(big != NULL);
+    memset(big, 1, 3 * huge);
+
+    // Trimming releases whole huge pages
+    mm_free(big);
+    size_t before = resident_bytes();
+    assert(mm_trim(0) == 1);
+    assert(resident_bytes() + 2 * huge <= before);
+    memset(small, 2, 100);
+
+    mm_free(small);
+    mm_cleanup();
+    mm_mallopt(MM_OPT_HUGE_PAGES, 0);
+    mm_mallopt(MM_OPT_MMAP_THRESHOLD, 256 * 1024);
+    mm_mallopt(MM_OPT_DECOMMIT_THRESHOLD, 1024 * 1024);
+#endif
+    printf("\ntest_huge_pages PASSED\n\n");
+}
+
+#ifndef USE_SYSTEM_MALLOC
+#define ISOLATION_OBJECTS 48
+
+static void* isolation_worker(void* arg) {
+    char** ptrs = arg;
+    for (int i = 0; i < ISOLATION_OBJECTS; i++)
+        ptrs[i] = mm_malloc(16 + (i * 7) % 90);
+    return NULL;
+}
+
+// Whether any cache line holds bytes of both a and b
+static int share_line(char** a, char** b) {
+    for (int i = 0; i < ISOLATION_OBJECTS; i++) {
+        for (int j = 0; j < ISOLATION_OBJECTS; j++) {
+            if (!a[i] || !b[j])
+                continue;
+            uintptr_t a_lo = (uintptr_t)a[i] / 64, a_hi = ((uintptr_t)a[i] + mm_usable_size(a[i]) - 1) / 64;
+            uintptr_t b_lo = (uintptr_t)b[j] / 64, b_hi = ((uintptr_t)b[j] + mm_usable_size(b[j]) - 1) / 64;
+            if (a_lo <= b_hi && b_lo <= a_hi)
+                return 1;
+        }
+    }
+    return 0;
+}
+#endif
+
+void test_cache_isolation() {
+#ifndef USE_SYSTEM_MALLOC
+    assert(mm_mallopt(MM_OPT_CACHE_ISOLATION, 1) == 0);
+    mm_init(1 << 16);
+    char* first[ISOLATION_OBJECTS];
+    char* second[ISOLATION_OBJECTS];
+    char* mine[ISOLATION_OBJECTS];
+
+    pthread_t threads[2];
+    pthread_create(&threads[0], NULL, isolation_worker, first);
+    pthread_create(&threads[1], NULL, isolation_worker, second);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    // Blocks freed by another thread are not reused by it
+    mm_free(first[3]);
+    mm_free_sized(second[5], 16 + (5 * 7) % 90);
+    first[3] = second[5] = NULL;
+    isolation_worker(mine);
+
+    assert(!share_line(first, second));
+    assert(!share_line(first, mine));
+    assert(!share_line(second, mine));
+
+    for (int i = 0; i < ISOLATION_OBJECTS; i++) {
+        mm_free(first[i]);
+        mm_free(second[i]);
+        mm_free(mine[i]);
+    }
+    mm_mallopt(MM_OPT_CACHE_ISOLATION, 0);
+    mm_cleanup();
+#endif
+    printf("\ntest_cache_isolation PASSED\n\n");
+}
+
+#ifndef USE_SYSTEM_MALLOC
+// Allocate and free in bursts, so the thread cache keeps overflowing
+static void* central_worker(void* arg) {
+    unsigned char** ptrs = arg;
+    for (int round = 0; round < 50; round++) {
+        for (int i = 0; i < 200; i++) {
+            ptrs[i] = mm_malloc(64);
+            assert(ptrs[i] != NULL);
+            memset(ptrs[i], i, 64);
+        }
+        for (int i = 0; i < 200; i++) {
+            assert(ptrs[i][0] == (unsigned char)i && ptrs[i][63] == (unsigned char)i);
+            mm_free(ptrs[i]);
+        }
+    }
+    return NULL;
+}
+#endif
+
+void test_central_free_list() {
+#ifndef USE_SYSTEM_MALLOC
+    mm_init(1 << 16);
+
+    // A cache that runs dry refills with a batch another thread gave up
+    void* theirs[200];
+    pthread_t thread;
+    pthread_create(&thread, NULL, central_worker, theirs);
+    pthread_join(thread, NULL);
+    void* mine = mm_malloc(64);
+    int found = 0;
+    for (int i = 0; i < 200; i++)
+        found |= theirs[i] == mine;
+    assert(found);
+    mm_free(mine);
+
+    // Threads trading batches keep their blocks intact
+    pthread_t threads[8];
+    void* ptrs[8][200];
+    for (int i = 0; i < 8; i++)
+        pthread_create(&threads[i], NULL, central_worker, ptrs[i]);
+    for (int i = 0; i < 8; i++)
+        pthread_join(threads[i], NULL);
+
+    // mm_trim hands the parked batches back to the heaps
+    struct mm_stats stats;
+    mm_trim(0);
+    mm_stats(&stats);
+    assert(stats.bytes_in_use == 0);
+    mm_cleanup();
+#endif
+    printf("\ntest_central_free_list PASSED\n\n");
+}
+
+#ifndef USE_SYSTEM_MALLOC
+struct walk_check {
+    void** live;
+    int n_live;
+    void* freed;
+    int found_live;
+    int found_freed;
+    int blocks;
+    int stop_after;
+};
+
+static int walk_visit(void* ptr, size_t size, int free, void* ctx) {
+    struct walk_check* check = ctx;
+    for (int i = 0; i < check->n_live; i++) {
+        if (check->live[i] == ptr && !free && size == mm_usable_size(ptr))
+            check->found_live++;
+    }
+    if (ptr == check->freed && free)
+        check->found_freed++;
+    return ++check->blocks == check->stop_after ? 7 : 0;
+}
+
+// Replace a random block of the heap; churn.slots is kept full
+struct walk_churn {
+    mm_heap_t* heap;
+    void* slots[64];
+    unsigned seed;
+    int blocks;
+};
+
+static void walk_churn_step(struct walk_churn* churn) {
+    int i = rand_r(&churn->seed) % 64;
+    mm_free(churn->slots[i]);
+    churn->slots[i] = mm_heap_malloc(churn->heap, 600 + rand_r(&churn->seed) % 4000);
+    assert(churn->slots[i] != NULL);
+}
+
+static int walk_and_churn(void* ptr, size_t size, int free, void* ctx) {
+    (void)ptr, (void)size, (void)free;
+    struct walk_churn* churn = ctx;
+    churn->blocks++;
+    walk_churn_step(churn); // Splits and merges blocks around the paused walk
+    return 0;
+}
+
+static atomic_int walk_churning;
+
+static void* walk_churn_thread(void* arg) {
+    for (int i = 0; i < 20000; i++)
+        walk_churn_step(arg);
+    atomic_store(&walk_churning, 0);
+    return NULL;
+}
+
+static int walk_count(void* ptr, size_t size, int free, void* ctx) {
+    (void)ptr, (void)size, (void)free;
+    ++*(int*)ctx;
+    return 0;
+}
+#endif
+
+void test_walk() {
+#ifndef USE_SYSTEM_MALLOC
+    mm_init(1 << 16);
+
+    // Blocks too big for the thread cache, with a freed one between two live ones
+    void* ptrs[6];
+    for (int i = 0; i < 6; i++)
+        ptrs[i] = mm_malloc(1000 + i * 8);
+    mm_free(ptrs[2]);
+    void* live[5] = { ptrs[0], ptrs[1], ptrs[3], ptrs[4], ptrs[5] };
+    struct walk_check check = { live, 5, ptrs[2], 0, 0, 0, -1 };
+    assert(mm_walk(walk_visit, &check) == 0);
+    assert(check.found_live == 5 && check.found_freed == 1);
+
+    // A nonzero result ends the walk
+    struct walk_check partial = { live, 5, NULL, 0, 0, 0, 3 };
+    assert(mm_walk(walk_visit, &partial) == 7 && partial.blocks == 3);
+
+    // The map lists every block and a summary by size
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mm_map_test_%d", (int)getpid());
+    FILE* file = fopen(path, "w+");
+    assert(file != NULL);
+    assert(mm_dump_map(fileno(file)) == 0);
+    static char map[1 << 16];
+    rewind(file);
+    size_t len = fread(map, 1, sizeof(map) - 1, file);
+    map[len] = '\0';
+    fclose(file);
+    remove(path);
+    char entry[64];
+    snprintf(entry, sizeof(entry), "[%zu,%zu,0]", (size_t)(uintptr_t)ptrs[0], mm_usable_size(ptrs[0]));
+    assert(strncmp(map, "{\"heaps\":[{\"id\":0,\"blocks\":[", 28) == 0);
+    assert(strstr(map, entry) != NULL);
+    assert(strstr(map, "{\"max\":1024,\"used\":") != NULL);
+    assert(len > 2 && strcmp(map + len - 2, "}\n") == 0);
+
+    // Walks finish while the heap keeps changing under them, from the
+    // callback itself and from another thread
+    struct walk_churn churn = { mm_heap_create(1 << 20), { 0 }, 1, 0 };
+    assert(churn.heap != NULL);
+    for (int i = 0; i < 64; i++)
+        walk_churn_step(&churn);
+    for (int i = 0; i < 20; i++) {
+        churn.blocks = 0;
+        assert(mm_walk(walk_and_churn, &churn) == 0 && churn.blocks >= 64);
+    }
+    atomic_store(&walk_churning, 1);
+    pthread_t thread;
+    pthread_create(&thread, NULL, walk_churn_thread, &churn);
+    while (atomic_load(&walk_churning)) {
+        int blocks = 0;
+        assert(mm_walk(walk_count, &blocks) == 0 && blocks > 0);
+    }
+    pthread_join(thread, NULL);
+    mm_heap_destroy(churn.heap);
+
+    for (int i = 0; i < 6; i++) {
+        if (i != 2)
+            mm_free(ptrs[i]);
+    }
+    mm_cleanup();
+#endif
+    printf("\ntest_walk PASSED\n\n");
+}
+
+#ifndef USE_SYSTEM_MALLOC
+// An allocation site the profile must point back to
+__attribute__((noinline)) static void* profiled_site(size_t size) {
+    void* ptr = mm_malloc(size);
+    __asm__ volatile("" ::: "memory"); // Keep the call from becoming a tail call
+    return ptr;
+}
+
+// Dump the heap profile, returning the number of samples of size bytes;
+// *in_site is set if one of their innermost frames lies in profiled_site
+static int profile_samples(size_t size, int* in_site) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mm_profile_test_%d", (int)getpid());
+    FILE* file = fopen(path, "w+");
+    assert(file != NULL);
+    assert(mm_profile_dump(fileno(file)) == 0);
+    rewind(file);
+
+    char line[1024];
+    assert(fgets(line, sizeof(line), file) && strncmp(line, "heap profile: ", 14) == 0);
+    assert(strstr(line, " @ heap_v2/") != NULL);
+    int samples = 0, mapped = 0;
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "1: %zu [1: %zu] @ ", size, size);
+    while (fgets(line, sizeof(line), file)) {
+        mapped |= strcmp(line, "MAPPED_LIBRARIES:\n") == 0;
+        if (strncmp(line, prefix, strlen(prefix)) != 0)
+            continue;
+        samples++;
+        uintptr_t frame = (uintptr_t)strtoull(line + strlen(prefix), NULL, 16);
+        if (in_site && frame > (uintptr_t)profiled_site && frame < (uintptr_t)profiled_site + 256)
+            *in_site = 1;
+    }
+    fclose(file);
+    remove(path);
+    assert(mapped);
+    return samples;
+}
+#endif
+
+void test_heap_profile() {
+#ifndef USE_SYSTEM_MALLOC
+    mm_init(1 << 20);
+
+    // A rate of one byte samples every allocation, with its call stack
+    assert(mm_mallopt(MM_OPT_SAMPLE_RATE, 1) == 0);
+    void* ptrs[100];
+    for (int i = 0; i < 100; i++)
+        ptrs[i] = profiled_site(1000);
+    int in_site = 0;
+    assert(profile_samples(1000, &in_site) == 100 && in_site);
+
+    // Samples leave with their blocks, however those are freed
+    for (int i = 0; i < 50; i++)
+        mm_free(ptrs[i]);
+    mm_free_batch(ptrs + 50, 25);
+    for (int i = 75; i < 99; i++)
+        mm_free_sized(ptrs[i], 1000);
+    ptrs[99] = mm_realloc(ptrs[99], 2000);
+    assert(profile_samples(1000, NULL) == 0 && profile_samples(2000, NULL) == 1);
+    mm_free(ptrs[99]);
+    void* big = mm_malloc(1 << 20); // mmapped
+    assert(profile_samples(1 << 20, NULL) == 1);
+    mm_free(big);
+    mm_heap_t* heap = mm_heap_create(0);
+    mm_heap_malloc(heap, 3000);
+    assert(profile_samples(3000, NULL) == 1);
+    mm_heap_destroy(heap);
+    assert(profile_samples(3000, NULL) == 0);
+
+    // Samples come about once per rate bytes: 10000 * 64 bytes at an
+    // average of 4096 bytes apart makes about 156
+    assert(mm_mallopt(MM_OPT_SAMPLE_RATE, 4096) == 0);
+    static void* small[10000];
+    for (int i = 0; i < 10000; i++)
+        small[i] = mm_malloc(64);
+    int samples = profile_samples(64, NULL);
+    assert(samples > 80 && samples < 300);
+    for (int i = 0; i < 10000; i++)
+        mm_free(small[i]);
+
+    // Off again: nothing new is sampled
+    assert(mm_mallopt(MM_OPT_SAMPLE_RATE, 0) == 0);
+    for (int i = 0; i < 100; i++)
+        ptrs[i] = mm_malloc(48);
+    assert(profile_samples(48, NULL) == 0);
+    for (int i = 0; i < 100; i++)
+        mm_free(ptrs[i]);
+    mm_cleanup();
+#endif
+    printf("\ntest_heap_profile PASSED\n\n");
+}
+
+#ifndef USE_SYSTEM_MALLOC
+static void* numa_worker(void* arg) {
+    *(void**)arg = mm_malloc(2000);
+    return NULL;
+}
+#endif
+
+void test_numa_arenas() {
+#ifndef USE_SYSTEM_MALLOC
+    mm_init(1 << 16);
+
+    // The node count is the highest id in the kernel's list plus one,
+    // falling back to 1 when there are more nodes than arenas
+    size_t nodes = 1;
+    FILE* file = fopen("/sys/devices/system/node/possible", "r");
+    if (file) {
+        char list[64] = "";
+        if (fgets(list, sizeof(list), file)) {
+            char* last = list + strcspn(list, "\n");
+            while (last > list && last[-1] >= '0' && last[-1] <= '9')
+                last--;
+            nodes = strtoul(last, NULL, 10) + 1;
+        }
+        fclose(file);
+    }
+    struct mm_stats stats;
+    mm_stats(&stats);
+    assert(stats.arenas >= 1 && stats.arenas <= 64);
+    assert(stats.numa_nodes >= 1 && stats.numa_nodes <= stats.arenas);
+    assert(stats.numa_nodes == (nodes > stats.arenas ? 1 : nodes));
+
+    // Every thread allocates from one of the arenas
+    void* ptrs[16];
+    pthread_t threads[16];
+    for (int i = 0; i < 16; i++)
+        pthread_create(&threads[i], NULL, numa_worker, &ptrs[i]);
+    for (int i = 0; i < 16; i++)
+        pthread_join(threads[i], NULL);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mm_numa_test_%d", (int)getpid());
+    file = fopen(path, "w+");
+    assert(file != NULL);
+    assert(mm_dump_map(fileno(file)) == 0);
+    static char map[1 << 16];
+    rewind(file);
+    size_t len = fread(map, 1, sizeof(map) - 1, file);
+    map[len] = '\0';
+    fclose(file);
+    remove(path);
+    for (int i = 0; i < 16; i++) {
+        assert(ptrs[i] != NULL);
+        char entry[32];
+        snprintf(entry, sizeof(entry), "[%zu,", (size_t)(uintptr_t)ptrs[i]);
+        char* at = strstr(map, entry);
+        assert(at != NULL);
+        unsigned id = 0;
+        for (char* p = map; (p = strstr(p, "{\"id\":")) && p < at; p++)
+            id = (unsigned)strtoul(p + 6, NULL, 10);
+        assert(id < stats.arenas);
+        mm_free(ptrs[i]);
+    }
+    mm_cleanup();
+#endif
+    printf("\ntest_numa_arenas PASSED\n\n");
+}
+
 void test_memory_pattern() {
     mm_init(1024);
     size_t size = 256;
@@ -115,7 +1106,403 @@ void test_same_size_allocations() {
     printf("\ntest_same_size_allocations PASSED\n\n");
 }
 
+void test_larger_free_block_used() {
+    mm_init(1024);
+    void* small = mm_malloc(64);
+    void* guard = mm_malloc(16);
+    assert(small != NULL && guard != NULL);
+
+    // The freed 64-byte block is now the smallest free block; a larger
+    // request must still be served from the remaining space.
+    mm_free(small);
+    void* big = mm_malloc(512);
+    assert(big != NULL);
+
+    mm_free(big);
+    mm_free(guard);
+    mm_cleanup();
+    printf("\ntest_larger_free_block_used PASSED\n\n");
+}
+
+void test_calloc() {
+    mm_init(1024);
+
+    // Dirty a block, free it and make sure calloc hands it back zeroed
+    unsigned char* dirty = mm_malloc(128);
+    assert(dirty != NULL);
+    memset(dirty, 0xAA, 128);
+    mm_free(dirty);
+
+    unsigned char* zeroed = mm_calloc(16, 8);
+    assert(zeroed != NULL);
+    for (size_t i = 0; i < 128; i++) {
+        assert(zeroed[i] == 0);
+    }
+
+    // count * size must not wrap around
+    volatile size_t huge_count = (size_t)-1;
+    assert(mm_calloc(huge_count, 2) == NULL);
+
+    mm_free(zeroed);
+    mm_cleanup();
+
+    // Memory a block grew into in place and gave back is no longer fresh
+    mm_init(1 << 16);
+    unsigned char* grown = mm_realloc(mm_malloc(1000), 8000);
+    assert(grown != NULL);
+    memset(grown, 0x5A, 8000);
+    grown = mm_realloc(grown, 1000);
+    zeroed = mm_calloc(1, 4000);
+    assert(zeroed != NULL);
+    for (size_t i = 0; i < 4000; i++) {
+        assert(zeroed[i] == 0);
+    }
+    mm_free(zeroed);
+    mm_free(grown);
+    mm_cleanup();
+
+    // A freed block merges with the fresh top block; a block split from
+    // the merged one right after still reads as zero
+    mm_init(1 << 16);
+    unsigned char* merged = mm_malloc(1000);
+    assert(merged != NULL);
+    memset(merged, 0x3C, 1000);
+    mm_free(merged);
+    merged = mm_calloc(1, 992);
+    zeroed = mm_calloc(1, 4000);
+    assert(merged != NULL && zeroed != NULL);
+    for (size_t i = 0; i < 992; i++) {
+        assert(merged[i] == 0);
+    }
+    for (size_t i = 0; i < 4000; i++) {
+        assert(zeroed[i] == 0);
+    }
+    mm_free(zeroed);
+    mm_free(merged);
+    mm_cleanup();
+
+    // A heap that grows in place merges its free top block with the new
+    // memory. Sweep the initial size so that, whatever the program break,
+    // some run ends the first segment on a page boundary, where the new
+    // memory joins the fresh range it had.
+    for (size_t extra = 0; extra < 4096; extra += 8) {
+        mm_init(8192 + extra);
+        unsigned char* used = mm_malloc(3000);
+        assert(used != NULL);
+        memset(used, 0x70, 3000);
+        zeroed = mm_calloc(1, 20000);
+        assert(zeroed != NULL);
+        for (size_t i = 0; i < 20000; i++) {
+            assert(zeroed[i] == 0);
+        }
+        mm_free(zeroed);
+        mm_free(used);
+        mm_cleanup();
+    }
+    printf("\ntest_calloc PASSED\n\n");
+}
+
+void test_heap_growth() {
+    mm_init(1024);
+    void* ptrs[64];
+
+    // Far more than the initial region; the heap has to grow
+    for (int i = 0; i < 64; i++) {
+        ptrs[i] = mm_malloc(4096);
+        assert(ptrs[i] != NULL);
+        memset(ptrs[i], i, 4096);
+    }
+    for (int i = 0; i < 64; i++) {
+        assert(((unsigned char*)ptrs[i])[4095] == i);
+        mm_free(ptrs[i]);
+    }
+
+    void* big = mm_malloc(1 << 20);
+    assert(big != NULL);
+    memset(big, 0x55, 1 << 20);
+    mm_free(big);
+
+    mm_cleanup();
+    printf("\ntest_heap_growth PASSED\n\n");
+}
+
+void test_large_mapped_allocation() {
+    mm_init(1024);
+#ifndef USE_SYSTEM_MALLOC
+    assert(mm_mallopt(MM_OPT_MMAP_THRESHOLD, 128 * 1024) == 0);
+    assert(mm_mallopt(-1, 0) == -1);
+#endif
+
+    size_t size = 512 * 1024;
+    unsigned char* ptr = mm_calloc(1, size);
+    assert(ptr != NULL);
+    for (size_t i = 0; i < size; i += 4096) {
+        assert(ptr[i] == 0);
+    }
+    memset(ptr, 0x5A, size);
+
+    // Growing keeps the contents, whether the mapping moves or not
+    ptr = mm_realloc(ptr, 4 * size);
+    assert(ptr != NULL);
+    assert(ptr[0] == 0x5A && ptr[size - 1] == 0x5A);
+    memset(ptr + size, 0x33, 3 * size);
+
+    mm_free(ptr);
+    mm_cleanup();
+    printf("\ntest_large_mapped_allocation PASSED\n\n");
+}
+
+void test_best_fit() {
+    mm_init(1 << 16);
+    size_t sizes[3] = { 4000, 1200, 2000 };
+    void* blocks[3];
+    void* guards[3];
+
+    // Guards too big for the thread cache keep the blocks in address order
+    for (int i = 0; i < 3; i++) {
+        blocks[i] = mm_malloc(sizes[i]);
+        guards[i] = mm_malloc(600);
+        assert(blocks[i] != NULL && guards[i] != NULL);
+    }
+    for (int i = 0; i < 3; i++) {
+        mm_free(blocks[i]);
+    }
+
+    // Each request must land in the smallest free block that fits it
+    void* fit1100 = mm_malloc(1100);
+    void* fit1900 = mm_malloc(1900);
+    assert(fit1100 != NULL && fit1900 != NULL);
+#ifndef USE_SYSTEM_MALLOC
+    assert(fit1100 == blocks[1]);
+    assert(fit1900 == blocks[2]);
+#endif
+
+    mm_free(fit1100);
+    mm_free(fit1900);
+    for (int i = 0; i < 3; i++) {
+        mm_free(guards[i]);
+    }
+    mm_cleanup();
+    printf("\ntest_best_fit PASSED\n\n");
+}
+
+#define POOL_OBJECTS 5000
+
+void test_pool() {
+#ifndef USE_SYSTEM_MALLOC
+    mm_init(1 << 16);
+    mm_pool_t* pool = mm_pool_create(64);
+    assert(pool != NULL);
+    static unsigned char* objs[POOL_OBJECTS];
+
+    // More objects than fit in one slab; all must be distinct and packed
+    for (int i = 0; i < POOL_OBJECTS; i++) {
+        objs[i] = mm_pool_alloc(pool);
+        assert(objs[i] != NULL);
+        memset(objs[i], i & 0xFF, 64);
+    }
+    assert(objs[1] - objs[0] == 64);
+    for (int i = 0; i < POOL_OBJECTS; i++) {
+        assert(objs[i][63] == (i & 0xFF));
+    }
+
+    // Freed objects are handed out again before the pool grows
+    mm_pool_free(pool, objs[10]);
+    mm_pool_free(pool, objs[20]);
+    assert(mm_pool_alloc(pool) == objs[20]);
+    assert(mm_pool_alloc(pool) == objs[10]);
+
+    mm_pool_destroy(pool);
+    mm_cleanup();
+#endif
+    printf("\ntest_pool PASSED\n\n");
+}
+
+void test_arena() {
+#ifndef USE_SYSTEM_MALLOC
+    mm_init(1 << 16);
+    mm_arena_t* arena = mm_arena_create(4096);
+    assert(arena != NULL);
+
+    // Consecutive small allocations are bumped out of the same chunk
+    char* first = mm_arena_alloc(arena, 10);
+    char* second = mm_arena_alloc(arena, 10);
+    assert(first != NULL && second == first + 16);
+
+    // Enough to spill into new chunks, plus one oversized request
+    for (int i = 0; i < 100; i++) {
+        char* ptr = mm_arena_alloc(arena, 200);
+        assert(ptr != NULL);
+        memset(ptr, i, 200);
+    }
+    char* big = mm_arena_alloc(arena, 20000);
+    assert(big != NULL);
+    memset(big, 0x77, 20000);
+
+    // After a reset the arena starts over at its first chunk
+    mm_arena_reset(arena);
+    assert(mm_arena_alloc(arena, 10) == first);
+    mm_arena_destroy(arena);
+
+    // An oversized request while the first chunk is the only one must not
+    // make the reset keep the oversized chunk instead
+    arena = mm_arena_create(4096);
+    first = mm_arena_alloc(arena, 10);
+    big = mm_arena_alloc(arena, 20000);
+    assert(first != NULL && big != NULL);
+    mm_arena_reset(arena);
+    assert(mm_arena_alloc(arena, 10) == first);
+    assert(mm_usable_size(first - 16) < 20000); // Behind the chunk header
+
+    mm_arena_destroy(arena);
+    mm_cleanup();
+#endif
+    printf("\ntest_arena PASSED\n\n");
+}
+
+#define FRAGMENT_COUNT 4096
+
+void test_many_free_fragments() {
+    mm_init(1 << 22);
+    static void* fragments[FRAGMENT_COUNT];
+    static void* guards[FRAGMENT_COUNT];
+
+    // Guards keep the freed blocks apart so none of them can coalesce
+    for (int i = 0; i < FRAGMENT_COUNT; i++) {
+        fragments[i] = mm_malloc(600);
+        guards[i] = mm_malloc(16);
+        assert(fragments[i] != NULL && guards[i] != NULL);
+    }
+    void* last_fragment = fragments[FRAGMENT_COUNT - 1];
+    for (int i = 0; i < FRAGMENT_COUNT; i++) {
+        mm_free(fragments[i]);
+    }
+
+    // Every fragment must still be tracked and handed out again
+    for (int i = 0; i < FRAGMENT_COUNT; i++) {
+        fragments[i] = mm_malloc(600);
+        assert(fragments[i] != NULL);
+#ifndef USE_SYSTEM_MALLOC
+        assert(fragments[i] <= last_fragment);
+#endif
+    }
+    (void)last_fragment;
+
+    for (int i = 0; i < FRAGMENT_COUNT; i++) {
+        mm_free(fragments[i]);
+        mm_free(guards[i]);
+    }
+    mm_cleanup();
+    printf("\ntest_many_free_fragments PASSED\n\n");
+}
+
+#define THREAD_COUNT 4
+#define THREAD_ROUNDS 20000
+#define THREAD_SLOTS 64
+
+static void* thread_churn(void* arg) {
+    unsigned seed = (unsigned)(size_t)arg;
+    unsigned char* slots[THREAD_SLOTS] = { NULL };
+    size_t sizes[THREAD_SLOTS] = { 0 };
+    unsigned char tag = (unsigned char)(size_t)arg;
+
+    for (int round = 0; round < THREAD_ROUNDS; round++) {
+        int i = rand_r(&seed) % THREAD_SLOTS;
+        if (slots[i]) {
+            // Another thread writing into our block would break the pattern
+            for (size_t j = 0; j < sizes[i]; j++) {
+                assert(slots[i][j] == tag);
+            }
+            mm_free(slots[i]);
+            slots[i] = NULL;
+        } else {
+            sizes[i] = 1 + rand_r(&seed) % (round % 8 == 0 ? 2048 : 256);
+            slots[i] = mm_malloc(sizes[i]);
+            assert(slots[i] != NULL);
+            memset(slots[i], tag, sizes[i]);
+        }
+    }
+
+    for (int i = 0; i < THREAD_SLOTS; i++) {
+        mm_free(slots[i]);
+    }
+    return NULL;
+}
+
+void test_threads() {
+    mm_init(1 << 20);
+    pthread_t threads[THREAD_COUNT];
+
+    for (size_t t = 0; t < THREAD_COUNT; t++) {
+        pthread_create(&threads[t], NULL, thread_churn, (void*)(t + 1));
+    }
+    for (int t = 0; t < THREAD_COUNT; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    mm_cleanup();
+    printf("\ntest_threads PASSED\n\n");
+}
+
+#define HANDOFF_ROUNDS 20
+#define HANDOFF_BLOCKS 256
+
+static void* handoff[HANDOFF_BLOCKS];
+static pthread_barrier_t handoff_barrier;
+
+static size_t handoff_size(int i) {
+    return i % 4 == 0 ? 64 : 600 + (size_t)i * 13;
+}
+
+static void* handoff_producer(void* arg) {
+    (void)arg;
+    for (int round = 0; round < HANDOFF_ROUNDS; round++) {
+        for (int i = 0; i < HANDOFF_BLOCKS; i++) {
+            handoff[i] = mm_malloc(handoff_size(i));
+            assert(handoff[i] != NULL);
+            memset(handoff[i], i & 0xFF, handoff_size(i));
+        }
+        pthread_barrier_wait(&handoff_barrier); // Hand the blocks over
+        pthread_barrier_wait(&handoff_barrier); // Wait until they are freed
+    }
+    return NULL;
+}
+
+static void* handoff_consumer(void* arg) {
+    (void)arg;
+    for (int round = 0; round < HANDOFF_ROUNDS; round++) {
+        pthread_barrier_wait(&handoff_barrier);
+        for (int i = 0; i < HANDOFF_BLOCKS; i++) {
+            assert(((unsigned char*)handoff[i])[handoff_size(i) - 1] == (i & 0xFF));
+            mm_free(handoff[i]);
+        }
+        pthread_barrier_wait(&handoff_barrier);
+    }
+    return NULL;
+}
+
+void test_cross_thread_free() {
+    // Each round needs most of the heap, so blocks freed by the consumer
+    // must make it back to the producer's arena
+    mm_init(1 << 20);
+    pthread_t producer, consumer;
+
+    pthread_barrier_init(&handoff_barrier, NULL, 2);
+    pthread_create(&producer, NULL, handoff_producer, NULL);
+    pthread_create(&consumer, NULL, handoff_consumer, NULL);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+    pthread_barrier_destroy(&handoff_barrier);
+
+    mm_cleanup();
+    printf("\ntest_cross_thread_free PASSED\n\n");
+}
+
 int main(int argc, char* argv[]) {
+#ifndef USE_SYSTEM_MALLOC
+    // Hardened builds would otherwise delay the reuse the tests check for
+    mm_mallopt(MM_OPT_QUARANTINE, 0);
+#endif
     if (argc == 3 && strcmp(argv[1], "-t") == 0) {
         int test_num = atoi(argv[2]);
 
@@ -127,6 +1514,34 @@ int main(int argc, char* argv[]) {
             case 5: test_exact_size_allocation(); break;
             case 6: test_same_size_allocations(); break;
             case 7: test_memory_pattern(); break;
+            case 8: test_larger_free_block_used(); break;
+            case 9: test_calloc(); break;
+            case 10: test_threads(); break;
+            case 11: test_cross_thread_free(); break;
+            case 12: test_heap_growth(); break;
+            case 13: test_large_mapped_allocation(); break;
+            case 14: test_realloc_in_place(); break;
+            case 15: test_many_free_fragments(); break;
+            case 16: test_best_fit(); break;
+            case 17: test_pool(); break;
+            case 18: test_arena(); break;
+            case 19: test_header_overhead(); break;
+            case 20: test_aligned_alloc(); break;
+            case 21: test_lazy_init(); break;
+            case 22: test_fork(); break;
+            case 23: test_stats(); break;
+            case 24: test_trace(); break;
+            case 25: test_trim(); break;
+            case 26: test_hardened(); break;
+            case 27: test_sized_free(); break;
+            case 28: test_batch(); break;
+            case 29: test_heap_instances(); break;
+            case 30: test_huge_pages(); break;
+            case 31: test_cache_isolation(); break;
+            case 32: test_central_free_list(); break;
+            case 33: test_walk(); break;
+            case 34: test_heap_profile(); break;
+            case 35: test_numa_arenas(); break;
             default: printf("Invalid test number.\n"); break;
         }
         return 0;
@@ -140,6 +1555,34 @@ int main(int argc, char* argv[]) {
     test_exact_size_allocation();
     test_same_size_allocations();
     test_memory_pattern();
+    test_larger_free_block_used();
+    test_calloc();
+    test_threads();
+    test_cross_thread_free();
+    test_heap_growth();
+    test_large_mapped_allocation();
+    test_realloc_in_place();
+    test_many_free_fragments();
+    test_best_fit();
+    test_pool();
+    test_arena();
+    test_header_overhead();
+    test_aligned_alloc();
+    test_lazy_init();
+    test_fork();
+    test_stats();
+    test_trace();
+    test_trim();
+    test_hardened();
+    test_sized_free();
+    test_batch();
+    test_heap_instances();
+    test_huge_pages();
+    test_cache_isolation();
+    test_central_free_list();
+    test_walk();
+    test_heap_profile();
+    test_numa_arenas();
 
     return 0;
 }